@@ -0,0 +1,151 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "prog3_stats.h"
+
+/*------------------------------------------------------------------------
+* Program: chatstat
+*
+* Purpose: top-like view of a running server's statistics. Reads the
+* shared memory segment the server publishes, so watching costs the
+* server nothing.
+*
+* Syntax: ./chatstat [-i seconds] [-n count] parPort|statsName
+*
+* seconds   - refresh interval (default 1)
+* count     - number of refreshes, 0 for forever (default 0)
+* parPort   - participant port of the server, for the default segment name
+* statsName - segment name given to the server with -m
+*
+*------------------------------------------------------------------------
+*/
+
+void printView(const statsSegment* segment, const statsPayload* now, const statsPayload* before);
+void printRate(const char* name, uint64_t now, uint64_t before, double seconds);
+
+int main(int argc, char **argv) {
+	const statsSegment* segment;
+	statsPayload now, before;
+	char name[64];
+	int interval = 1;
+	int count = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+		}
+	}
+
+	if (argc - optind != 1 || interval <= 0) {
+		fprintf(stderr,"Error: Wrong number of arguments\n");
+		fprintf(stderr,"usage:\n");
+		fprintf(stderr,"./chatstat [-i seconds] [-n count] parPort|statsName\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (argv[optind][0] == '/') {
+		snprintf(name, sizeof(name), "%s", argv[optind]);
+	} else {
+		snprintf(name, sizeof(name), STATS_NAME_FORMAT, atoi(argv[optind]));
+	}
+
+	segment = statsAttach(name);
+	if (!segment) {
+		fprintf(stderr, "Error: Cannot open statistics segment %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (statsRead(segment, &before) < 0) {
+		fprintf(stderr, "Error: Statistics segment %s has an unknown layout\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; !count || i < count; i++) {
+		sleep(interval);
+
+		if (statsRead(segment, &now) < 0) {
+			fprintf(stderr, "Error: Statistics segment %s has an unknown layout\n", name);
+			exit(EXIT_FAILURE);
+		}
+
+		printView(segment, &now, &before);
+		before = now;
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+void printView(const statsSegment* segment, const statsPayload* now, const statsPayload* before) {
+	const serverCounters* c = &now->counters;
+	const serverCounters* p = &before->counters;
+	double seconds = (now->publishedNs - before->publishedNs) / 1e9;
+	int alive = kill(segment->pid, 0) == 0;
+
+	// Clear screen, cursor home
+	printf("\033[H\033[2J");
+	printf("server pid %d%s, up %.0fs, last update %.1fs ago\n\n",
+		segment->pid,
+		alive ? "" : " (not running)",
+		(nowNs() - segment->startedNs) / 1e9,
+		(nowNs() - now->publishedNs) / 1e9);
+
+	printf("participants %-8llu observers %-8llu pending observers %llu\n\n",
+		(unsigned long long)now->participants,
+		(unsigned long long)now->observers,
+		(unsigned long long)now->observersPending);
+
+	printf("%-24s %14s %12s\n", "counter", "total", "per sec");
+	printRate("connections accepted", c->connectionsAccepted, p->connectionsAccepted, seconds);
+	printRate("connections rejected", c->connectionsRejected, p->connectionsRejected, seconds);
+	printRate("accepts overflowed", c->acceptsOverflowed, p->acceptsOverflowed, seconds);
+	printRate("accept budget hits", c->acceptBudgetHits, p->acceptBudgetHits, seconds);
+	printRate("participant disconnects", c->participantDisconnects, p->participantDisconnects, seconds);
+	printRate("observer disconnects", c->observerDisconnects, p->observerDisconnects, seconds);
+	printRate("messages in", c->messagesIn, p->messagesIn, seconds);
+	printRate("bytes in", c->bytesIn, p->bytesIn, seconds);
+	printRate("messages out", c->messagesOut, p->messagesOut, seconds);
+	printRate("bytes out", c->bytesOut, p->bytesOut, seconds);
+	printRate("drops", c->drops, p->drops, seconds);
+	printRate("messages delayed", c->messagesDelayed, p->messagesDelayed, seconds);
+	printRate("messages rejected", c->messagesRejected, p->messagesRejected, seconds);
+	printRate("handshake timeouts", c->handshakeTimeouts, p->handshakeTimeouts, seconds);
+	printRate("idle timeouts", c->idleTimeouts, p->idleTimeouts, seconds);
+	printRate("pings sent", c->pingsSent, p->pingsSent, seconds);
+	printRate("pongs received", c->pongsReceived, p->pongsReceived, seconds);
+	printRate("peers reaped", c->peersReaped, p->peersReaped, seconds);
+	printRate("node frames in", c->nodeFramesIn, p->nodeFramesIn, seconds);
+	printRate("node frames out", c->nodeFramesOut, p->nodeFramesOut, seconds);
+	printRate("node links lost", c->nodeLinksLost, p->nodeLinksLost, seconds);
+	printRate("ring overruns", c->ringOverruns, p->ringOverruns, seconds);
+	printRate("ring wakeups", c->ringWakeups, p->ringWakeups, seconds);
+	printRate("feed sent", c->feedSent, p->feedSent, seconds);
+	printRate("feed nacks", c->feedNacks, p->feedNacks, seconds);
+	printRate("feed resent", c->feedResent, p->feedResent, seconds);
+	printRate("roster full", c->rosterFull, p->rosterFull, seconds);
+	printRate("roster deltas", c->rosterDeltas, p->rosterDeltas, seconds);
+	printRate("loop iterations", c->loopIterations, p->loopIterations, seconds);
+	printf("%-24s %11.1fus %10.1fus max\n\n", "loop lag", c->loopLastNs / 1000.0, c->loopMaxNs / 1000.0);
+
+	histPrint(stdout, "ingress", &now->ingress);
+	histPrint(stdout, "send", &now->send);
+	histPrint(stdout, "loop", &now->loop);
+	histPrint(stdout, "rtt", &now->rtt);
+	fflush(stdout);
+}
+
+void printRate(const char* name, uint64_t now, uint64_t before, double seconds) {
+	double rate = (seconds > 0) ? (now - before) / seconds : 0;
+
+	printf("%-24s %14llu %12.1f\n", name, (unsigned long long)now, rate);
+}
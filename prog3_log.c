@@ -0,0 +1,198 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "prog3_log.h"
+
+#define LOG_SLOTS 1024 /* must be a power of two */
+#define LOG_LINE 240 /* longer lines are truncated */
+
+/*
+* Bounded multi-producer ring: each slot carries a sequence number that
+* says whose turn it is. A producer owns the slot when sequence == its
+* position, publishes it by setting position + 1, and the writer hands it
+* back for the next lap by setting position + LOG_SLOTS.
+*/
+typedef struct logSlot {
+	uint64_t sequence;
+	uint64_t realtimeNs;
+	int level;
+	int length;
+	char text[LOG_LINE];
+} logSlot;
+
+int logLevel = LOG_LEVEL_INFO;
+
+static logSlot slots[LOG_SLOTS];
+static uint64_t enqueuePos = 0;
+static uint64_t writtenPos = 0; /* slots fully written out, for logFlush */
+static uint64_t dropped = 0;
+static uint32_t writerSleeping = 0; /* futex word, 1 while the writer waits */
+static int started = 0;
+static pthread_t writer;
+
+static const char* levelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static void wakeWriter(void) {
+	// Only the producer that flips the flag pays for the syscall
+	if (__atomic_exchange_n(&writerSleeping, 0, __ATOMIC_SEQ_CST)) {
+		syscall(SYS_futex, &writerSleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static void writeSlot(logSlot* slot) {
+	FILE* out = (slot->level <= LOG_LEVEL_WARN) ? stderr : stdout;
+	time_t seconds = slot->realtimeNs / 1000000000ull;
+	struct tm local;
+	char clock[16];
+
+	localtime_r(&seconds, &local);
+	strftime(clock, sizeof(clock), "%H:%M:%S", &local);
+
+	fprintf(out, "%s.%03d %-5s ", clock, (int)((slot->realtimeNs / 1000000) % 1000), levelNames[slot->level]);
+	fwrite(slot->text, 1, slot->length, out);
+	fputc('\n', out);
+}
+
+static void* writerMain(void* unused) {
+	uint64_t position = 0;
+
+	(void)unused;
+
+	while (1) {
+		logSlot* slot = &slots[position & (LOG_SLOTS - 1)];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == position + 1) {
+			writeSlot(slot);
+			__atomic_store_n(&slot->sequence, position + LOG_SLOTS, __ATOMIC_RELEASE);
+			position++;
+			continue;
+		}
+
+		// Ring drained, push the batch out before sleeping
+		fflush(stdout);
+		fflush(stderr);
+		__atomic_store_n(&writtenPos, position, __ATOMIC_RELEASE);
+
+		__atomic_store_n(&writerSleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) == position + 1) {
+			__atomic_store_n(&writerSleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// Producers clear the flag before waking us, so a late wake is never lost
+		struct timespec timeout = { 0, 100 * 1000000 };
+		syscall(SYS_futex, &writerSleeping, FUTEX_WAIT_PRIVATE, 1, &timeout, NULL, 0);
+		__atomic_store_n(&writerSleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int logInit(int level) {
+	logLevel = level;
+
+	for (int i = 0; i < LOG_SLOTS; i++) {
+		slots[i].sequence = i;
+	}
+
+	if (pthread_create(&writer, NULL, writerMain, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(writer);
+
+	started = 1;
+	atexit(logFlush);
+	return 0;
+}
+
+void logWrite(int level, const char* format, ...) {
+	struct timespec now;
+	logSlot* slot;
+	uint64_t position;
+	va_list args;
+
+	// Before logInit (or if it failed) write straight through
+	if (!started) {
+		FILE* out = (level <= LOG_LEVEL_WARN) ? stderr : stdout;
+
+		va_start(args, format);
+		vfprintf(out, format, args);
+		va_end(args);
+		fputc('\n', out);
+		fflush(out);
+		return;
+	}
+
+	// Claim a slot
+	position = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &slots[position & (LOG_SLOTS - 1)];
+		int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&enqueuePos, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// Full, the writer is a lap behind
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			position = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->realtimeNs = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	slot->level = level;
+
+	va_start(args, format);
+	slot->length = vsnprintf(slot->text, LOG_LINE, format, args);
+	va_end(args);
+
+	if (slot->length < 0) {
+		slot->length = 0;
+	} else if (slot->length >= LOG_LINE) {
+		slot->length = LOG_LINE - 1;
+	}
+
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_SEQ_CST);
+	wakeWriter();
+}
+
+void logFlush(void) {
+	uint64_t target;
+
+	if (!started) {
+		return;
+	}
+
+	// Wait for the writer to catch up with everything claimed so far
+	target = __atomic_load_n(&enqueuePos, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&writtenPos, __ATOMIC_ACQUIRE) < target) {
+		wakeWriter();
+		usleep(1000);
+	}
+}
+
+int logParseLevel(const char* name) {
+	for (int i = 0; i < (int)(sizeof(levelNames) / sizeof(levelNames[0])); i++) {
+		if (!strcasecmp(name, levelNames[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+uint64_t logDropped(void) {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+#ifndef PROG3_LOG_H
+#define PROG3_LOG_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------
+* Asynchronous leveled logger.
+*
+* Callers format into a slot of a bounded lock-free ring; a background
+* thread writes the slots out. A message above the current level costs
+* one compare, so debug logging stays compiled in. When the ring is full
+* the message is dropped and counted rather than blocking the caller.
+*------------------------------------------------------------------------
+*/
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+extern int logLevel;
+
+#define logMessage(level, ...) \
+	do { \
+		if ((level) <= logLevel) { \
+			logWrite((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define logError(...) logMessage(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define logWarn(...) logMessage(LOG_LEVEL_WARN, __VA_ARGS__)
+#define logInfo(...) logMessage(LOG_LEVEL_INFO, __VA_ARGS__)
+#define logDebug(...) logMessage(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Start the writer thread, returns -1 if it cannot be started
+int logInit(int level);
+
+// Format one line (no trailing newline needed) into the ring
+void logWrite(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Block until everything logged so far has been written
+void logFlush(void);
+
+// "error", "warn", "info" or "debug", -1 if unknown
+int logParseLevel(const char* name);
+
+// Messages lost because the ring was full
+uint64_t logDropped(void);
+
+#endif
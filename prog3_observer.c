@@ -1,6 +1,9 @@
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -10,15 +13,54 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "prog3_proto.h"
+#include "prog3_ring.h"
+#include "prog3_stats.h"
+
+void readStream(int sd);
+void readRing(int sd);
+void readFeed(char* group, char* server);
+void printMessage(const char* message, int size);
+void takeMessage(const char* message, int size);
+void sinkReport(void);
+void sinkStop(int signal);
+
+#define MAX_FRAME 1014 /* largest message the server sends */
+#define RECV_BUFFER 65536 /* socket read at a time */
+#define OUTPUT_BUFFER 65536 /* stdout written at a time */
+#define STAMP_OFFSET 14 /* a message's text starts after ">   username: " */
+
+// Headless (-w or -d): nothing on the terminal, a report on exit
+int headless = 0;
+FILE* record = NULL; /* frames as received, NULL = discard */
+volatile sig_atomic_t stopping = 0;
+uint64_t sinkMessages = 0;
+uint64_t sinkBytes = 0;
+uint64_t sinkLost = 0; /* dropped by the server, ring only */
+uint64_t sinkFirst = 0, sinkLast = 0; /* monotonic ns */
+histogram sinkLatency; /* stamped messages only */
+
+#define FEED_WINDOW 1024 /* out of order messages held back, a power of two */
+#define FEED_NACK_MS 200 /* between asking again for the same gap */
+#define FEED_NACK_TRIES 5 /* then give up on it */
+#define FEED_SILENCE_MS 5000 /* no heartbeat for this long, the server is gone */
+
 /*------------------------------------------------------------------------
 * Program: demo_client
 *
 * Purpose: allocate a socket, connect to a server, and print all output
 *
-* Syntax: ./demo_client server_address server_port
+* Syntax: ./demo_client [-w file username | -d username] server_address server_port
+*         ./demo_client [-w file username | -d username] socket_path
+*         ./demo_client -M group:port server_address
 *
 * server_address - name of a computer on which server is executing
 * server_port    - protocol port number server is using
+* socket_path    - Unix socket of a server on this host (its -U or -O)
+* group:port     - the server's multicast feed (its -M), public messages only
+* -w             - headless: observe username, write the frames to file as
+*                  received and report rates and latency on exit
+* -d             - headless, but throw the frames away
 *
 *------------------------------------------------------------------------
 */
@@ -39,49 +81,103 @@ int main( int argc, char **argv) {
 	memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
 	sad.sin_family = AF_INET; /* set family to Internet */
 
-	if( argc != 3 ) {
-		fprintf(stderr,"Error: Wrong number of arguments\n");
-		fprintf(stderr,"usage:\n");
-		fprintf(stderr,"./client server_address server_port\n");
-		exit(EXIT_FAILURE);
-	}
+	// Messages are written out in big batches, flushed before we wait
+	setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
 
-	port = atoi(argv[2]); /* convert to binary */
-	if (port > 0) {
-		sad.sin_port = htons((u_short)port);
-	} else {
-		fprintf(stderr,"Error: bad port number %s\n",argv[2]);
-		exit(EXIT_FAILURE);
+	if (argc == 4 && !strcmp(argv[1], "-M")) {
+		readFeed(argv[2], argv[3]);
 	}
 
-	host = argv[1]; /* if host argument specified */
+	// Headless, the username comes from the command line
+	char* headlessName = NULL;
+	if (argc > 3 && !strcmp(argv[1], "-w")) {
+		record = fopen(argv[2], "w");
+		if (!record) {
+			fprintf(stderr,"Error: Cannot open %s\n", argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		setvbuf(record, NULL, _IOFBF, OUTPUT_BUFFER);
+		headlessName = argv[3];
+		argc -= 3;
+		argv += 3;
+	} else if (argc > 2 && !strcmp(argv[1], "-d")) {
+		headlessName = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 
-	/* Convert host name to equivalent IP address and copy to sad. */
-	ptrh = gethostbyname(host);
-	if ( ptrh == NULL ) {
-		fprintf(stderr,"Error: Invalid host: %s\n", host);
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr,"Error: Wrong number of arguments\n");
+		fprintf(stderr,"usage:\n");
+		fprintf(stderr,"./client [-w file username | -d username] server_address server_port\n");
+		fprintf(stderr,"./client [-w file username | -d username] socket_path\n");
+		fprintf(stderr,"./client -M group:port server_address\n");
 		exit(EXIT_FAILURE);
 	}
 
-	memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+	if (headlessName) {
+		struct sigaction action;
 
-	/* Map TCP transport protocol name to protocol number. */
-	if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
-		fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
-		exit(EXIT_FAILURE);
-	}
+		if (strlen(headlessName) < 1 || strlen(headlessName) > 10) {
+			fprintf(stderr,"Error: bad username %s\n", headlessName);
+			exit(EXIT_FAILURE);
+		}
 
-	/* Create a socket. */
-	sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
-	if (sd < 0) {
-		fprintf(stderr, "Error: Socket creation failed\n");
-		exit(EXIT_FAILURE);
+		// No SA_RESTART, a signal has to get us out of select
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = sinkStop;
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+
+		headless = 1;
+		atexit(sinkReport);
 	}
 
-	/* Connect the socket to the specified server. You have to pass correct parameters to the connect function.*/
-	if (connect(sd, (struct sockaddr*) &sad, sizeof(sad)) < 0) {
-		fprintf(stderr,"connect failed\n");
-		exit(EXIT_FAILURE);
+	if (argc == 2) {
+		// Server on this host, skip the TCP stack
+		sd = protoConnectUnix(argv[1]);
+		if (sd < 0) {
+			fprintf(stderr,"connect failed\n");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		port = atoi(argv[2]); /* convert to binary */
+		if (port > 0) {
+			sad.sin_port = htons((u_short)port);
+		} else {
+			fprintf(stderr,"Error: bad port number %s\n",argv[2]);
+			exit(EXIT_FAILURE);
+		}
+
+		host = argv[1]; /* if host argument specified */
+
+		/* Convert host name to equivalent IP address and copy to sad. */
+		ptrh = gethostbyname(host);
+		if ( ptrh == NULL ) {
+			fprintf(stderr,"Error: Invalid host: %s\n", host);
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+
+		/* Map TCP transport protocol name to protocol number. */
+		if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
+			fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Create a socket. */
+		sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
+		if (sd < 0) {
+			fprintf(stderr, "Error: Socket creation failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Connect the socket to the specified server. You have to pass correct parameters to the connect function.*/
+		if (connect(sd, (struct sockaddr*) &sad, sizeof(sad)) < 0) {
+			fprintf(stderr,"connect failed\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
     // Get Response
@@ -97,11 +193,38 @@ int main( int argc, char **argv) {
        exit(EXIT_FAILURE);
     }
 
+    // Ask for keepalive pings, so the server can tell we are still here.
+    // On the same host a shared-memory ring beats both.
+    int caps = protoHello(sd, PROTO_CAP_PING | ((argc == 2) ? PROTO_CAP_RING : 0), &response);
+    if (caps < 0 && !response) {
+       fprintf(stderr, "Error: Server closed the connection.\n");
+       close(sd);
+       exit(EXIT_FAILURE);
+    }
+    if (caps < 0) {
+       // An older server took the hello for a bad username and is waiting
+       // for a real one, so carry on without pings or a ring
+       caps = 0;
+    }
+
     // Get Username
-    char username[10];
+    char username[11];
     uint8_t size;
 
     int connected = 0;
+
+    // Nobody to ask for another name
+    if (headless) {
+        size = strlen(headlessName);
+        send(sd, &size, sizeof(uint8_t), 0);
+        send(sd, headlessName, size, 0);
+        if (recv(sd, &response, 1, MSG_WAITALL) != 1 || response != 'Y') {
+            fprintf(stderr, "Error: Cannot observe %s.\n", headlessName);
+            close(sd);
+            exit(EXIT_FAILURE);
+        }
+        connected = 1;
+    }
     while(!connected) {
         FD_SET(0, &sdSet);
 
@@ -130,7 +253,7 @@ int main( int argc, char **argv) {
 
         // Send Username
         send(sd, &size, sizeof(uint8_t), 0);
-        send(sd, username, strlen(username), 0);
+        send(sd, username, size, 0);
 
         // Wait for a response
         recv(sd, &response, 1, 0);
@@ -152,52 +275,462 @@ int main( int argc, char **argv) {
         }
     }
 
+    if (caps & PROTO_CAP_RING) {
+        readRing(sd);
+    }
+
+    readStream(sd);
+}
+
+// Reads as much as the socket has and prints every whole frame in it. A
+// frame cut off at the end of the buffer waits for the next read.
+void readStream(int sd) {
+    static char buffer[RECV_BUFFER];
+    int start = 0, end = 0;
+    fd_set sdSet;
+
     while (1) {
-        char message[1015];
-        char message_size;
-        int ready;
+        ssize_t got;
+
+        fflush(stdout);
+
+        FD_ZERO(&sdSet);
+        if (!headless) {
+            FD_SET(0, &sdSet);
+        }
+        FD_SET(sd, &sdSet);
+
+        if (select(sd + 1, &sdSet, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR && stopping) {
+                exit(EXIT_SUCCESS);
+            }
+            printf ("Select error\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (FD_ISSET(0, &sdSet)) {
+            char command[6];
+
+            fgets(command, sizeof(command), stdin);
+
+            if (!strcmp(command, "/quit")) {
+                close(sd);
+                exit(EXIT_SUCCESS);
+            }
+        }
+
+        if (!FD_ISSET(sd, &sdSet)) {
+            continue;
+        }
+
+        got = recv(sd, buffer + end, sizeof(buffer) - end, 0);
+        if (got < 0 && errno == EINTR) {
+            if (stopping) {
+                exit(EXIT_SUCCESS);
+            }
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        end += got;
+
+        while (end - start >= (int)sizeof(uint16_t)) {
+            uint16_t size;
+            int length;
+
+            memcpy(&size, buffer + start, sizeof(uint16_t));
+            length = size & ~PROTO_CONTROL;
+            if (length > MAX_FRAME) {
+                fprintf(stderr, "Error: Invalid message from server.\n");
+                close(sd);
+                exit(EXIT_FAILURE);
+            }
+            if (end - start < (int)sizeof(uint16_t) + length) {
+                break;
+            }
+
+            // Keepalive, answer it and keep going
+            if (size & PROTO_CONTROL) {
+                protoControl(sd, buffer + start + sizeof(uint16_t), length);
+            } else {
+                takeMessage(buffer + start, length);
+            }
+            start += sizeof(uint16_t) + length;
+        }
+
+        // Keep room for a whole frame after what is left
+        if (start == end) {
+            start = end = 0;
+        } else if (sizeof(buffer) - start < sizeof(uint16_t) + MAX_FRAME) {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+        }
+    }
+
+    fflush(stdout);
+    if (!headless) {
+        printf("Server died\n");
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// One frame, size included: shown, or counted and recorded when headless
+void takeMessage(const char* frame, int size) {
+    const char* message = frame + sizeof(uint16_t);
+    uint64_t now;
+
+    if (!headless) {
+        printMessage(message, size);
+        return;
+    }
+
+    now = nowNs();
+    if (!sinkMessages) {
+        sinkFirst = now;
+    }
+    sinkLast = now;
+    sinkMessages++;
+    sinkBytes += size;
+
+    if (record) {
+        fwrite(frame, 1, sizeof(uint16_t) + size, record);
+    }
+
+    // Stamped by the sender (participant -t): "#<realtime ns> "
+    if (size > STAMP_OFFSET + 1 && message[STAMP_OFFSET] == '#') {
+        struct timespec real;
+        char stamp[21];
+        int length = size - STAMP_OFFSET - 1;
+        uint64_t sentAt;
+
+        memcpy(stamp, message + STAMP_OFFSET + 1, (length < 20) ? length : 20);
+        stamp[(length < 20) ? length : 20] = '\0';
+        sentAt = strtoull(stamp, NULL, 10);
+
+        clock_gettime(CLOCK_REALTIME, &real);
+        now = (uint64_t)real.tv_sec * 1000000000ull + real.tv_nsec;
+        if (sentAt && sentAt <= now) {
+            histRecord(&sinkLatency, now - sentAt);
+        }
+    }
+}
+
+// atexit, so every way out of a headless run reports
+void sinkReport(void) {
+    double seconds = (sinkLast - sinkFirst) / 1e9;
+
+    if (record) {
+        fclose(record);
+    }
+
+    fprintf(stderr, "Received %llu messages, %llu bytes in %.3f s", (unsigned long long)sinkMessages,
+            (unsigned long long)sinkBytes, seconds);
+    if (seconds > 0) {
+        fprintf(stderr, ": %.0f messages/s, %.0f bytes/s", sinkMessages / seconds, sinkBytes / seconds);
+    }
+    fprintf(stderr, "\n");
+    if (sinkLost) {
+        fprintf(stderr, "Lost %llu messages the server could not fit in the ring\n", (unsigned long long)sinkLost);
+    }
+
+    if (sinkLatency.count) {
+        histPrint(stderr, "latency", &sinkLatency);
+    }
+}
+
+void sinkStop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+// Into the stdout buffer, with a newline if the message has none
+void printMessage(const char* message, int size) {
+    fwrite(message, 1, size, stdout);
+    if (!size || message[size - 1] != '\n') {
+        putchar('\n');
+    }
+}
+
+// Messages arrive in shared memory, the socket only tells us the server is gone
+void readRing(int sd) {
+    ringStruct ring;
+    int memFD, eventFD;
+    char message[sizeof(uint16_t) + 1015];
+    uint64_t lost = 0;
+    int alive = 1;
+    fd_set sdSet;
+
+    if (protoReceiveRing(sd, &memFD, &eventFD) < 0 || ringMap(&ring, memFD, eventFD) < 0) {
+        fprintf(stderr, "Error: Cannot map the server's ring.\n");
+        close(sd);
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        int size;
+
+        // Room for the size in front, so a headless run records what a socket would carry
+        while ((size = ringGet(&ring, message + sizeof(uint16_t), sizeof(message) - sizeof(uint16_t))) >= 0) {
+            uint16_t frameSize = size;
+
+            memcpy(message, &frameSize, sizeof(uint16_t));
+            takeMessage(message, size);
+        }
+
+        // Fell behind and the server dropped some rather than wait for us
+        if (ring.header->lost != lost) {
+            if (headless) {
+                sinkLost += ring.header->lost - lost;
+            } else {
+                printf("(%llu messages lost)\n", (unsigned long long)(ring.header->lost - lost));
+            }
+            lost = ring.header->lost;
+        }
+
+        // Whatever was written before the server went is in the ring by now
+        if (!alive) {
+            break;
+        }
+
+        if (!ringSleep(&ring)) {
+            continue;
+        }
+        fflush(stdout);
+
+        FD_ZERO(&sdSet);
+        if (!headless) {
+            FD_SET(0, &sdSet);
+        }
+        FD_SET(sd, &sdSet);
+        FD_SET(ring.eventFD, &sdSet);
+
+        if (select(((sd > ring.eventFD) ? sd : ring.eventFD) + 1, &sdSet, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR && stopping) {
+                exit(EXIT_SUCCESS);
+            }
+            printf ("Select error\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (FD_ISSET(ring.eventFD, &sdSet)) {
+            ringWoken(&ring);
+        }
+
+        if (FD_ISSET(0, &sdSet)) {
+            fgets(message, 6, stdin);
+
+            if (!strcmp(message, "/quit")) {
+                close(sd);
+                exit(EXIT_SUCCESS);
+            }
+        }
+
+        if (FD_ISSET(sd, &sdSet) && recv(sd, message, sizeof(message), 0) <= 0) {
+            if (errno == EINTR && stopping) {
+                exit(EXIT_SUCCESS);
+            }
+            alive = 0;
+        }
+    }
+
+    if (!headless) {
+        printf("Server died\n");
+    }
+    exit(EXIT_SUCCESS);
+}
+
+static uint64_t nowMs() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Messages arrive as datagrams, in any order or not at all. Holds back what
+// comes early, asks the server for the gaps and prints in sequence.
+void readFeed(char* group, char* server) {
+    static struct {
+        uint64_t sequence; /* 0 = empty */
+        uint16_t size;
+        char body[1015];
+    } window[FEED_WINDOW];
+    struct sockaddr_in groupAddress, repair, local;
+    struct ip_mreq membership;
+    struct hostent *ptrh;
+    socklen_t localSize = sizeof(local);
+    char copy[64];
+    char* port;
+    int sd, repairSD, on = 1;
+    uint64_t next = 0; /* next one to print, 0 = haven't heard anything yet */
+    uint64_t highest = 0; /* highest the server has sent, as far as we know */
+    uint64_t nackedAt = 0, heardAt = nowMs();
+    int tries = 0;
+    fd_set sdSet;
+
+    snprintf(copy, sizeof(copy), "%s", group);
+    port = strrchr(copy, ':');
+    if (port) {
+        *port++ = '\0';
+    }
+
+    memset(&groupAddress, 0, sizeof(groupAddress));
+    groupAddress.sin_family = AF_INET;
+    if (!port || atoi(port) <= 0 || !inet_aton(copy, &groupAddress.sin_addr)) {
+        fprintf(stderr,"Error: bad multicast group %s\n", group);
+        exit(EXIT_FAILURE);
+    }
+    groupAddress.sin_port = htons(atoi(port));
+
+    ptrh = gethostbyname(server);
+    if (ptrh == NULL) {
+        fprintf(stderr,"Error: Invalid host: %s\n", server);
+        exit(EXIT_FAILURE);
+    }
+    memset(&repair, 0, sizeof(repair));
+    repair.sin_family = AF_INET;
+    repair.sin_port = htons(atoi(port) + 1);
+    memcpy(&repair.sin_addr, ptrh->h_addr, ptrh->h_length);
+
+    // NACKs go out, and repairs come back, on a port of our own. Other
+    // receivers on this host share the group port.
+    repairSD = socket(PF_INET, SOCK_DGRAM, 0);
+    if (repairSD < 0 || connect(repairSD, (struct sockaddr*) &repair, sizeof(repair)) < 0) {
+        fprintf(stderr, "Error: Cannot reach %s\n", server);
+        exit(EXIT_FAILURE);
+    }
+
+    // Join on whichever interface faces the server
+    membership.imr_multiaddr = groupAddress.sin_addr;
+    membership.imr_interface.s_addr = INADDR_ANY;
+    if (getsockname(repairSD, (struct sockaddr*) &local, &localSize) == 0) {
+        membership.imr_interface = local.sin_addr;
+    }
+
+    sd = socket(PF_INET, SOCK_DGRAM, 0);
+    groupAddress.sin_addr.s_addr = INADDR_ANY;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (sd < 0 || bind(sd, (struct sockaddr*) &groupAddress, sizeof(groupAddress)) < 0
+            || setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        fprintf(stderr, "Error: Cannot join multicast group %s\n", group);
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        struct timeval timeout = { 0, FEED_NACK_MS * 1000 };
+        char datagram[PROTO_FEED_HEADER + 1015];
+        uint64_t sequence, now;
+        uint16_t size;
+        ssize_t got;
 
         FD_ZERO(&sdSet);
         FD_SET(0, &sdSet);
         FD_SET(sd, &sdSet);
+        FD_SET(repairSD, &sdSet);
 
-        ready = select(sd + 1, &sdSet, NULL, NULL, NULL);
+        if (select(((sd > repairSD) ? sd : repairSD) + 1, &sdSet, NULL, NULL, &timeout) < 0) {
+            printf ("Select error\n");
+            exit(EXIT_FAILURE);
+        }
 
-        if (ready > 0) {
+        if (FD_ISSET(0, &sdSet)) {
+            fgets(datagram, 6, stdin);
 
-            if (FD_ISSET(0, &sdSet)) {
+            if (!strcmp(datagram, "/quit")) {
+                close(sd);
+                exit(EXIT_SUCCESS);
+            }
+        }
 
-                fgets(message, 6, stdin);
+        now = nowMs();
 
-                if (!strcmp(message, "/quit")) {
-                    close(sd);
-                    exit(EXIT_SUCCESS);
-                }
+        // One datagram per pass, repairs first
+        if (FD_ISSET(repairSD, &sdSet)) {
+            got = recv(repairSD, datagram, sizeof(datagram), 0);
+        } else {
+            got = FD_ISSET(sd, &sdSet) ? recv(sd, datagram, sizeof(datagram), 0) : -1;
+        }
+        if (got >= PROTO_FEED_HEADER) {
+            memcpy(&sequence, datagram, sizeof(uint64_t));
+            memcpy(&size, datagram + sizeof(uint64_t), sizeof(uint16_t));
+            heardAt = now;
+
+            // Much older than what we print: a new server started over
+            if (next && sequence + FEED_WINDOW < next) {
+                memset(window, 0, sizeof(window));
+                next = highest = 0;
+            }
+            if (!next) {
+                next = (size == PROTO_FEED_BEAT) ? sequence + 1 : sequence;
+            }
+            if (sequence > highest) {
+                highest = sequence;
             }
 
-            if (FD_ISSET(sd, &sdSet)) {
+            // Too far ahead to hold, whatever it pushes out of the window is lost
+            if (size != PROTO_FEED_BEAT && sequence >= next + FEED_WINDOW) {
+                printf("(%llu messages lost)\n", (unsigned long long)(sequence - FEED_WINDOW + 1 - next));
+                next = sequence - FEED_WINDOW + 1;
+                tries = 0;
+            }
 
-                if (recv(sd, &message_size, sizeof(uint16_t), 0) <= 0) {
-                    break;
-                }
-                if (recv(sd, &message, message_size, 0) <= 0) {
-                    break;
+            if (size != PROTO_FEED_BEAT && sequence >= next
+                    && (size == PROTO_FEED_GONE || size == got - PROTO_FEED_HEADER)) {
+                window[sequence & (FEED_WINDOW - 1)].sequence = sequence;
+                window[sequence & (FEED_WINDOW - 1)].size = size;
+                if (size != PROTO_FEED_GONE) {
+                    memcpy(window[sequence & (FEED_WINDOW - 1)].body, datagram + PROTO_FEED_HEADER, size);
                 }
+            }
+        }
+
+        // Print everything that is now in order
+        while (next && window[next & (FEED_WINDOW - 1)].sequence == next) {
+            char* message = window[next & (FEED_WINDOW - 1)].body;
+
+            size = window[next & (FEED_WINDOW - 1)].size;
+            window[next & (FEED_WINDOW - 1)].sequence = 0;
+            next++;
+            tries = 0;
+
+            if (size == PROTO_FEED_GONE) {
+                printf("(1 messages lost)\n");
+            } else {
+                printMessage(message, size);
+            }
+        }
+        fflush(stdout);
+
+        if (now - heardAt >= FEED_SILENCE_MS) {
+            break;
+        }
+
+        // A gap: ask for it, and past a few tries stop waiting for it
+        if (next && next <= highest && now - nackedAt >= FEED_NACK_MS) {
+            char nack[PROTO_NACK_SIZE];
+            uint16_t count = (highest - next + 1 < 64) ? highest - next + 1 : 64;
 
-                message[message_size] = '\0';
+            if (tries == FEED_NACK_TRIES) {
+                uint64_t missing = 0;
 
-                if (message[message_size - 1] == '\n') {
-                    printf("%s", message);
-                } else {
-                    printf("%s\n", message);
+                while (next <= highest && window[next & (FEED_WINDOW - 1)].sequence != next) {
+                    next++;
+                    missing++;
                 }
+                printf("(%llu messages lost)\n", (unsigned long long)missing);
+                tries = 0;
+                continue;
             }
-        } else {
-            printf ("Select error\n");
-            exit(EXIT_FAILURE);
+
+            memcpy(nack, &next, sizeof(uint64_t));
+            memcpy(nack + sizeof(uint64_t), &count, sizeof(uint16_t));
+            send(repairSD, nack, sizeof(nack), 0);
+            nackedAt = now;
+            tries++;
         }
     }
-    
+
     printf("Server died\n");
     exit(EXIT_SUCCESS);
 }
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -9,16 +14,47 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "prog3_proto.h"
+
+#define MAX_MESSAGE 1000 /* the server's limit, longer lines go in pieces */
+#define BULK_BUFFER 65536 /* input read at a time */
+#define BULK_BATCH 256 /* messages per writev */
+#define STAMP_SIZE 21 /* "#", 19 digits of realtime ns, " " */
+#define ROSTER_MAX 8192 /* names we can keep track of */
+
+void sendBulk(int sd, int in, int stamped);
+void updateRoster(const char* update, uint16_t size);
+void printRoster();
+
+// Who is online, kept up to date once asked for with /who
+char roster[ROSTER_MAX][11];
+int rosterSize = 0;
+uint64_t rosterVersion = 0; /* 0 = never asked */
+int rosterWanted = 0; /* print it when the answer is complete */
 
 /*------------------------------------------------------------------------
 * Program: demo_client
 *
 * Purpose: allocate a socket, connect to a server, and print all output
 *
-* Syntax: ./demo_client server_address server_port
+* Syntax: ./demo_client [-o] server_address server_port
+*         ./demo_client [-o] socket_path
+*         ./demo_client [-t] -f file username server_address server_port
+*         ./demo_client [-t] -f file username socket_path
 *
 * server_address - name of a computer on which server is executing
 * server_port    - protocol port number server is using
+* socket_path    - Unix socket of a server on this host (its -U or -O)
+* -o             - also show what an observer would, over this one
+*                  connection (no separate observer needed)
+* -f             - send every line of file (- for stdin) as username,
+*                  as fast as the server takes them, then quit
+* -t             - with -f, start each message with the time it was sent,
+*                  for observer -w or -d to measure latency
+*
+* /who lists who is online, /quit leaves.
 *
 *------------------------------------------------------------------------
 */
@@ -31,6 +67,11 @@ int main( int argc, char **argv) {
 	char *host; /* pointer to host name */
 	int n; /* number of characters read */
 	char buf[1000]; /* buffer for data from the server */
+	char *bulkFile = NULL; /* -f, lines to send */
+	char *bulkName = NULL;
+	int stamped = 0;
+	int duplex = 0; /* -o, ask to observe ourselves */
+	int in = 0;
     fd_set rfds;
     struct timeval tv;
     tv.tv_sec = 10;
@@ -43,51 +84,99 @@ int main( int argc, char **argv) {
 	memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
 	sad.sin_family = AF_INET; /* set family to Internet */
 
-	if (argc != 3 ) {
-		fprintf(stderr,"Error: Wrong number of arguments\n");
-		fprintf(stderr,"usage:\n");
-		fprintf(stderr,"./client server_address server_port\n");
-		exit(EXIT_FAILURE);
+	if (argc > 2 && !strcmp(argv[1], "-o")) {
+		duplex = 1;
+		argc--;
+		argv++;
 	}
 
-	port = atoi(argv[2]); /* convert to binary */
-
-    // Test for legal value
-	if (port > 0) {
-		sad.sin_port = htons((u_short)port);
-	} else {
-		fprintf(stderr,"Error: bad port number %s\n",argv[2]);
-		exit(EXIT_FAILURE);
+	if (argc > 4 && !strcmp(argv[1], "-t")) {
+		stamped = 1;
+		argc--;
+		argv++;
 	}
 
-	host = argv[1]; /* if host argument specified */
+	if (argc > 3 && !strcmp(argv[1], "-f")) {
+		bulkFile = argv[2];
+		bulkName = argv[3];
+		argc -= 3;
+		argv += 3;
+	}
 
-	/* Convert host name to equivalent IP address and copy to sad. */
-	ptrh = gethostbyname(host);
-	if ( ptrh == NULL ) {
-		fprintf(stderr,"Error: Invalid host: %s\n", host);
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr,"Error: Wrong number of arguments\n");
+		fprintf(stderr,"usage:\n");
+		fprintf(stderr,"./client [-o] server_address server_port\n");
+		fprintf(stderr,"./client [-o] socket_path\n");
+		fprintf(stderr,"./client [-t] -f file username server_address server_port\n");
+		fprintf(stderr,"./client [-t] -f file username socket_path\n");
 		exit(EXIT_FAILURE);
 	}
 
-	memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
-
-	/* Map TCP transport protocol name to protocol number. */
-	if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
-		fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
+	if ((stamped && !bulkFile) || (duplex && bulkFile)) {
+		fprintf(stderr,"Error: -t needs -f, -o can't have it\n");
 		exit(EXIT_FAILURE);
 	}
 
-	/* Create a socket. */
-	sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
-	if (sd < 0) {
-		fprintf(stderr, "Error: Socket creation failed\n");
-		exit(EXIT_FAILURE);
+	if (bulkFile) {
+		if (strlen(bulkName) < 1 || strlen(bulkName) > 10) {
+			fprintf(stderr,"Error: bad username %s\n", bulkName);
+			exit(EXIT_FAILURE);
+		}
+		in = strcmp(bulkFile, "-") ? open(bulkFile, O_RDONLY) : 0;
+		if (in < 0) {
+			fprintf(stderr,"Error: Cannot open %s\n", bulkFile);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	/* Connect the socket to the specified server. You have to pass correct parameters to the connect function.*/
-	if (connect(sd, (struct sockaddr*) &sad, sizeof(sad)) < 0) {
-		fprintf(stderr,"connect failed\n");
-		exit(EXIT_FAILURE);
+	if (argc == 2) {
+		// Server on this host, skip the TCP stack
+		sd = protoConnectUnix(argv[1]);
+		if (sd < 0) {
+			fprintf(stderr,"connect failed\n");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		port = atoi(argv[2]); /* convert to binary */
+
+	    // Test for legal value
+		if (port > 0) {
+			sad.sin_port = htons((u_short)port);
+		} else {
+			fprintf(stderr,"Error: bad port number %s\n",argv[2]);
+			exit(EXIT_FAILURE);
+		}
+
+		host = argv[1]; /* if host argument specified */
+
+		/* Convert host name to equivalent IP address and copy to sad. */
+		ptrh = gethostbyname(host);
+		if ( ptrh == NULL ) {
+			fprintf(stderr,"Error: Invalid host: %s\n", host);
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+
+		/* Map TCP transport protocol name to protocol number. */
+		if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
+			fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Create a socket. */
+		sd = socket(PF_INET, SOCK_STREAM, ptrp->p_proto);
+		if (sd < 0) {
+			fprintf(stderr, "Error: Socket creation failed\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Connect the socket to the specified server. You have to pass correct parameters to the connect function.*/
+		if (connect(sd, (struct sockaddr*) &sad, sizeof(sad)) < 0) {
+			fprintf(stderr,"connect failed\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
     char max;
@@ -100,9 +189,42 @@ int main( int argc, char **argv) {
         exit(EXIT_SUCCESS);
     }
 
+    // Ask for keepalive pings, so the server can tell we are still here,
+    // the roster for /who, and with -o for our observer's messages too
+    int caps = protoHello(sd, PROTO_CAP_PING | PROTO_CAP_ROSTER | (duplex ? PROTO_CAP_DUPLEX : 0), &max);
+    if (caps < 0 && !max) {
+        fprintf(stderr, "Error: Server closed the connection.\n");
+        close(sd);
+        exit(EXIT_FAILURE);
+    }
+    if (caps < 0) {
+        // An older server took the hello for a bad username and is waiting
+        // for a real one, so carry on without pings, roster or duplex
+        caps = 0;
+    }
+    if (duplex && !(caps & PROTO_CAP_DUPLEX)) {
+        fprintf(stderr, "Warning: Server can't send messages here, use an observer.\n");
+    }
+
+    // No one to ask for another name
+    if (bulkFile) {
+        uint8_t username_size = strlen(bulkName);
+        char unique;
+
+        send(sd, &username_size, sizeof(uint8_t), 0);
+        send(sd, bulkName, username_size, 0);
+        if (recv(sd, &unique, 1, MSG_WAITALL) != 1 || unique != 'Y') {
+            fprintf(stderr, "Error: Username %s %s.\n", bulkName, (unique == 'T') ? "already taken" : "refused");
+            close(sd);
+            exit(EXIT_FAILURE);
+        }
+        sendBulk(sd, in, stamped);
+    }
+
     char unique = 'I';
     while(unique != 'Y') {
-        char username[10];
+        char username[16];
+        ssize_t got;
         uint8_t username_size;
         int retval;
         
@@ -120,7 +242,12 @@ int main( int argc, char **argv) {
 
         if (retval) {
             // Word entered within time limit
-            username_size = read(0, username, 15) - 1;
+            got = read(0, username, sizeof(username));
+            if (got <= 0) {
+                close(sd);
+                exit(EXIT_SUCCESS);
+            }
+            username_size = got - 1;
         } else {
             // No Word entered within time limit
             close(sd);
@@ -154,14 +281,71 @@ int main( int argc, char **argv) {
     }
 
     // Send Messages
+    int prompt = 1;
     while(1) {
-        char message[1000];
+        char message[1001];
         uint16_t size;
+        ssize_t got;
 
-        printf("Enter your message: ");
-        fflush(stdout);
+        if (prompt) {
+            printf("Enter your message: ");
+            fflush(stdout);
+            prompt = 0;
+        }
 
-        size = read(0, message, 1001) - 1;
+        // The server writes to us to ping, and in duplex mode with messages
+        FD_ZERO(&rfds);
+        FD_SET(0, &rfds);
+        FD_SET(sd, &rfds);
+
+        if (select(sd + 1, &rfds, NULL, NULL, NULL) < 0) {
+		    fprintf(stderr, "Error: Problem with select.\n");
+		    exit(EXIT_FAILURE);
+        }
+
+        if (FD_ISSET(sd, &rfds)) {
+            char incoming[1015];
+            uint16_t length;
+
+            if (recv(sd, &size, sizeof(uint16_t), MSG_WAITALL) <= 0) {
+                printf("\nServer died\n");
+                exit(EXIT_SUCCESS);
+            }
+            length = size & ~PROTO_CONTROL;
+            if (length >= sizeof(incoming) || recv(sd, incoming, length, MSG_WAITALL) <= 0) {
+                printf("\nServer died\n");
+                exit(EXIT_SUCCESS);
+            }
+
+            if ((size & PROTO_CONTROL) && length >= PROTO_ROSTER_HEADER && incoming[0] == PROTO_ROSTER_UPDATE) {
+                updateRoster(incoming, length);
+                if (rosterWanted && !(incoming[1] & PROTO_ROSTER_MORE)) {
+                    printRoster();
+                    rosterWanted = 0;
+                    prompt = 1;
+                }
+            } else if (size & PROTO_CONTROL) {
+                protoControl(sd, incoming, length);
+            } else {
+                // On a line of its own, then ask again
+                incoming[length] = '\0';
+                printf("\n%s%s", incoming, (length && incoming[length - 1] == '\n') ? "" : "\n");
+                prompt = 1;
+            }
+        }
+
+        if (!FD_ISSET(0, &rfds)) {
+            continue;
+        }
+        prompt = 1;
+
+        // End of input is the same as /quit
+        got = read(0, message, sizeof(message) - 1);
+        if (got <= 0) {
+            close(sd);
+            exit(EXIT_SUCCESS);
+        }
+        size = (message[got - 1] == '\n') ? got - 1 : got;
 
         message[size] = 0;
 
@@ -171,7 +355,199 @@ int main( int argc, char **argv) {
             exit(EXIT_SUCCESS);
         }
 
+        // Only what changed since we last asked comes back
+        if (!strcmp(message, "/who")) {
+            if (!(caps & PROTO_CAP_ROSTER)) {
+                printf("Server can't list users\n");
+            } else if (protoRoster(sd, rosterVersion) < 0) {
+                printf("\nServer died\n");
+                exit(EXIT_SUCCESS);
+            } else {
+                rosterWanted = 1;
+                prompt = 0;
+            }
+            continue;
+        }
+
         send(sd, &size, sizeof(uint16_t), 0);
 		send(sd, message, size, 0);
     }
 }
+
+// Frames whole lines straight out of the input buffer and sends them a batch
+// per writev. Answers pings in between, reports the rate at the end.
+void sendBulk(int sd, int in, int stamped) {
+    static char input[BULK_BUFFER];
+    uint16_t sizes[BULK_BATCH];
+    struct iovec iov[BULK_BATCH * 3];
+    char stamp[STAMP_SIZE + 1];
+    size_t stampSize = stamped ? STAMP_SIZE : 0;
+    struct timespec start, end;
+    unsigned long long messages = 0, bytes = 0;
+    double seconds;
+    int have = 0;
+    int done = 0;
+    fd_set rfds;
+
+    signal(SIGPIPE, SIG_IGN);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!done) {
+        char *line, *stop;
+        ssize_t got;
+        int count = 0;
+
+        FD_ZERO(&rfds);
+        FD_SET(in, &rfds);
+        FD_SET(sd, &rfds);
+
+        if (select(((sd > in) ? sd : in) + 1, &rfds, NULL, NULL, NULL) < 0) {
+            fprintf(stderr, "Error: Problem with select.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // The server only writes to us to ping
+        if (FD_ISSET(sd, &rfds)) {
+            char message[MAX_MESSAGE + 1];
+            uint16_t size;
+
+            if (recv(sd, &size, sizeof(uint16_t), MSG_WAITALL) <= 0) {
+                break;
+            }
+            size &= ~PROTO_CONTROL;
+            if (size > sizeof(message) || recv(sd, message, size, MSG_WAITALL) <= 0) {
+                break;
+            }
+            protoControl(sd, message, size);
+        }
+
+        if (!FD_ISSET(in, &rfds)) {
+            continue;
+        }
+
+        got = read(in, input + have, sizeof(input) - have);
+        if (got <= 0) {
+            // A last line without a newline still counts
+            if (have) {
+                input[have++] = '\n';
+            }
+            done = 1;
+        } else {
+            have += got;
+        }
+
+        // Whole lines only, the rest waits for the next read. A buffer with
+        // no newline at all is one long line.
+        line = input;
+        stop = memrchr(input, '\n', have);
+        if (!stop && have == sizeof(input)) {
+            stop = input + have;
+        }
+
+        while (line < stop) {
+            char *newline = memchr(line, '\n', stop - line);
+            size_t length = (newline ? newline : stop) - line;
+            ssize_t sent;
+            int i;
+
+            // Long lines in pieces the server will take
+            if (length > MAX_MESSAGE - stampSize) {
+                length = MAX_MESSAGE - stampSize;
+                newline = NULL;
+            }
+
+            // The whole batch shares one stamp, filled in as it goes out
+            if (length) {
+                sizes[count] = stampSize + length;
+                iov[count * 3].iov_base = &sizes[count];
+                iov[count * 3].iov_len = sizeof(uint16_t);
+                iov[count * 3 + 1].iov_base = stamp;
+                iov[count * 3 + 1].iov_len = stampSize;
+                iov[count * 3 + 2].iov_base = line;
+                iov[count * 3 + 2].iov_len = length;
+                bytes += stampSize + length;
+                count++;
+            }
+            line += length + (newline != NULL);
+
+            if (count < BULK_BATCH && line < stop) {
+                continue;
+            }
+
+            if (stamped) {
+                struct timespec now;
+
+                clock_gettime(CLOCK_REALTIME, &now);
+                snprintf(stamp, sizeof(stamp), "#%019llu ", (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec);
+            }
+
+            // A short write picks up where it stopped
+            for (i = 0; i < count * 3; ) {
+                sent = writev(sd, iov + i, count * 3 - i);
+                if (sent < 0) {
+                    fprintf(stderr, "Error: Server closed the connection.\n");
+                    exit(EXIT_FAILURE);
+                }
+                while (i < count * 3 && sent >= (ssize_t)iov[i].iov_len) {
+                    sent -= iov[i++].iov_len;
+                }
+                if (i < count * 3) {
+                    iov[i].iov_base = (char*)iov[i].iov_base + sent;
+                    iov[i].iov_len -= sent;
+                }
+            }
+            messages += count;
+            count = 0;
+        }
+
+        have -= line - input;
+        memmove(input, line, have);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Sent %llu messages, %llu bytes in %.3f s: %.0f messages/s, %.0f bytes/s\n",
+            messages, bytes, seconds, messages / seconds, bytes / seconds);
+
+    close(sd);
+    exit(EXIT_SUCCESS);
+}
+
+// Applies one PROTO_ROSTER_UPDATE to our copy of the roster
+void updateRoster(const char* update, uint16_t size) {
+    int offset = PROTO_ROSTER_HEADER;
+
+    if (update[1] & PROTO_ROSTER_RESET) {
+        rosterSize = 0;
+    }
+    memcpy(&rosterVersion, update + 2, sizeof(uint64_t));
+
+    while (offset + 2 <= size && offset + 2 + (uint8_t)update[offset + 1] <= size) {
+        char op = update[offset];
+        int length = (uint8_t)update[offset + 1];
+        char username[11];
+        int i;
+
+        snprintf(username, sizeof(username), "%.*s", length, update + offset + 2);
+        offset += 2 + length;
+
+        for (i = 0; i < rosterSize && strcmp(roster[i], username); i++) {
+        }
+        if (op == PROTO_ROSTER_ADD && i == rosterSize && rosterSize < ROSTER_MAX) {
+            strcpy(roster[rosterSize++], username);
+        } else if (op == PROTO_ROSTER_REMOVE && i < rosterSize) {
+            // The last name fills the gap, unless it is the one leaving
+            if (i != --rosterSize) {
+                strcpy(roster[i], roster[rosterSize]);
+            }
+        }
+    }
+}
+
+void printRoster() {
+    printf("\n%d online:", rosterSize);
+    for (int i = 0; i < rosterSize; i++) {
+        printf("%s %s", i ? "," : "", roster[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,216 @@
+#ifndef PROG3_PROTO_H
+#define PROG3_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*------------------------------------------------------------------------
+* Protocol extensions shared by the server and the clients.
+*
+* Capabilities are opt-in. Right after the server's 'Y' a client may send
+* a hello in place of its first username frame:
+*
+*     uint8 2, PROTO_HELLO, caps wanted
+*
+* PROTO_HELLO is not a valid username character, so this cannot be
+* mistaken for a name. The server answers PROTO_HELLO, caps granted and
+* the usual username exchange follows. Clients that never send a hello
+* get the original protocol.
+*
+* With PROTO_CAP_PING either side may find control frames in the message
+* stream: the uint16 size has PROTO_CONTROL set, the low bits give the
+* payload length and the payload starts with a type byte. The server
+* sends PROTO_PING with 8 opaque bytes, the client echoes them back in a
+* PROTO_PONG.
+*
+* PROTO_CAP_RING is only granted on the server's Unix sockets. Right
+* after the observer's 'Y' comes one control frame, PROTO_RING with the
+* ring size as a uint32, carrying a memfd and an eventfd as SCM_RIGHTS.
+* Every message after that is in the ring (prog3_ring.h), not on the
+* socket, and the server sends no pings.
+*
+* PROTO_CAP_DUPLEX is only granted to participants. Once the name is
+* accepted the participant's own connection carries every message its
+* observer would get, framed the same way, and no observer can attach
+* for that name.
+*
+* PROTO_CAP_GATEWAY is only granted by a server started with -g token.
+* The gateway sends the token where its name would go and gets 'Y', or
+* 'N' and the connection closed. From then on every message frame, both
+* ways, starts with a uint16 id for one of the gateway's users; public
+* messages come once, with PROTO_GATEWAY_ALL. Users are added with a
+* PROTO_REGISTER control frame (type, uint16 id, name), answered by
+* PROTO_REGISTERED (type, uint16 id, 'Y', 'N' or 'T'), and dropped with
+* PROTO_UNREGISTER (type, uint16 id). Ids are the gateway's choice.
+*
+* PROTO_CAP_ROSTER is only granted to participants. A PROTO_ROSTER
+* control frame (type, uint64 version known, 0 for none) is answered with
+* PROTO_ROSTER_UPDATE frames: type, flags, uint64 version, then entries of
+* op ('+' or '-'), uint8 length and a username. If the server still has
+* every change since the version given only those come, otherwise the
+* first frame has PROTO_ROSTER_RESET and the entries are the whole roster.
+* PROTO_ROSTER_MORE means another frame follows for the same version.
+* From then on each change is pushed as an update of its own.
+*------------------------------------------------------------------------
+*/
+
+/*------------------------------------------------------------------------
+* Multicast feed (server -M group:port).
+*
+* Every public message goes to the group once as a datagram: uint64
+* sequence number, uint16 size, body. Sequence numbers start at 1 and
+* have no gaps. Once a second a heartbeat carries the last sequence sent
+* so a lost final message is noticed too.
+*
+* Receivers ask for what they missed with a NACK datagram, uint64 first
+* sequence and uint16 count, sent to the server on the group port + 1.
+* The server resends them to the asker alone, or sends GONE for those it
+* no longer has.
+*------------------------------------------------------------------------
+*/
+
+#define PROTO_FEED_HEADER 10 /* uint64 sequence + uint16 size */
+#define PROTO_FEED_BEAT 0xFFFE /* size of a heartbeat, no body */
+#define PROTO_FEED_GONE 0xFFFF /* size of a message that can't be repaired */
+#define PROTO_NACK_SIZE 10 /* uint64 first sequence + uint16 count */
+
+#define PROTO_HELLO 0x01
+
+#define PROTO_CAP_PING 0x01
+#define PROTO_CAP_RING 0x02
+#define PROTO_CAP_DUPLEX 0x04
+#define PROTO_CAP_GATEWAY 0x08
+#define PROTO_CAP_ROSTER 0x10
+
+#define PROTO_CONTROL 0x8000
+#define PROTO_PING 1
+#define PROTO_PONG 2
+#define PROTO_RING 3
+#define PROTO_REGISTER 4
+#define PROTO_REGISTERED 5
+#define PROTO_UNREGISTER 6
+#define PROTO_ROSTER 7
+#define PROTO_ROSTER_UPDATE 8
+#define PROTO_PING_SIZE 9 /* type byte + 8 byte token */
+#define PROTO_RING_SIZE 5 /* type byte + uint32 ring size */
+#define PROTO_REGISTERED_SIZE 4 /* type byte + uint16 id + answer */
+
+#define PROTO_ROSTER_SIZE 9 /* type byte + uint64 version */
+#define PROTO_ROSTER_HEADER 10 /* type, flags, uint64 version */
+
+#define PROTO_GATEWAY_ALL 0xFFFF /* id on public messages to a gateway */
+
+#define PROTO_ROSTER_RESET 0x01 /* forget the roster, these entries are all of it */
+#define PROTO_ROSTER_MORE 0x02 /* the next frame continues this one */
+#define PROTO_ROSTER_ADD '+'
+#define PROTO_ROSTER_REMOVE '-'
+
+// Sends a hello and reads the answer. Returns the granted capabilities,
+// -1 if the server does not understand hellos (its reply is in *reply)
+static inline int protoHello(int sd, uint8_t caps, char* reply) {
+	uint8_t hello[3] = { 2, PROTO_HELLO, caps };
+	uint8_t answer[2];
+
+	if (send(sd, hello, sizeof(hello), 0) != sizeof(hello)) {
+		return -1;
+	}
+	if (recv(sd, answer, 1, MSG_WAITALL) != 1) {
+		*reply = 0;
+		return -1;
+	}
+	if (answer[0] != PROTO_HELLO) {
+		*reply = answer[0];
+		return -1;
+	}
+	if (recv(sd, answer + 1, 1, MSG_WAITALL) != 1) {
+		*reply = 0;
+		return -1;
+	}
+	return answer[1];
+}
+
+// Asks for the roster, or what changed since version. -1 on failure
+static inline int protoRoster(int sd, uint64_t version) {
+	char request[sizeof(uint16_t) + PROTO_ROSTER_SIZE];
+	uint16_t header = PROTO_CONTROL | PROTO_ROSTER_SIZE;
+
+	memcpy(request, &header, sizeof(uint16_t));
+	request[sizeof(uint16_t)] = PROTO_ROSTER;
+	memcpy(request + sizeof(uint16_t) + 1, &version, sizeof(uint64_t));
+	return (send(sd, request, sizeof(request), 0) == sizeof(request)) ? 0 : -1;
+}
+
+// Connects to a server's Unix socket (-U or -O), -1 on failure
+static inline int protoConnectUnix(const char* path) {
+	struct sockaddr_un address;
+	int sd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd < 0) {
+		return -1;
+	}
+	if (connect(sd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+		close(sd);
+		return -1;
+	}
+	return sd;
+}
+
+// Reads the PROTO_RING frame and the two descriptors riding on it
+// -1 = something else arrived, 0 = success
+static inline int protoReceiveRing(int sd, int* memFD, int* eventFD) {
+	char frame[sizeof(uint16_t) + PROTO_RING_SIZE];
+	char control[CMSG_SPACE(sizeof(int) * 2)];
+	struct iovec iov = { frame, sizeof(frame) };
+	struct msghdr message;
+	struct cmsghdr* header;
+	uint16_t size;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	if (recvmsg(sd, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(frame)) {
+		return -1;
+	}
+	memcpy(&size, frame, sizeof(uint16_t));
+	header = CMSG_FIRSTHDR(&message);
+	if (size != (PROTO_CONTROL | PROTO_RING_SIZE) || frame[sizeof(uint16_t)] != PROTO_RING || !header
+			|| header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+		return -1;
+	}
+
+	memcpy(memFD, CMSG_DATA(header), sizeof(int));
+	memcpy(eventFD, CMSG_DATA(header) + sizeof(int), sizeof(int));
+	return 0;
+}
+
+// Answers a control frame the client just read, PINGs get their PONG
+static inline int protoControl(int sd, const char* payload, uint16_t size) {
+	char pong[sizeof(uint16_t) + PROTO_PING_SIZE];
+	uint16_t header = PROTO_CONTROL | PROTO_PING_SIZE;
+
+	if (size != PROTO_PING_SIZE || payload[0] != PROTO_PING) {
+		return 0;
+	}
+
+	memcpy(pong, &header, sizeof(uint16_t));
+	pong[sizeof(uint16_t)] = PROTO_PONG;
+	memcpy(pong + sizeof(uint16_t) + 1, payload + 1, PROTO_PING_SIZE - 1);
+	return send(sd, pong, sizeof(pong), 0);
+}
+
+#endif
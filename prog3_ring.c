@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "prog3_ring.h"
+
+// Copies around the end of the data area as needed
+static void copyIn(ringHeader* header, uint64_t position, const char* from, uint32_t size) {
+	uint32_t offset = position & (header->size - 1);
+	uint32_t first = (size < header->size - offset) ? size : header->size - offset;
+
+	memcpy(header->data + offset, from, first);
+	memcpy(header->data, from + first, size - first);
+}
+
+static void copyOut(ringHeader* header, uint64_t position, char* to, uint32_t size) {
+	uint32_t offset = position & (header->size - 1);
+	uint32_t first = (size < header->size - offset) ? size : header->size - offset;
+
+	memcpy(to, header->data + offset, first);
+	memcpy(to + first, header->data, size - first);
+}
+
+int ringCreate(ringStruct* ring, uint32_t size) {
+	uint32_t dataSize = 4096;
+
+	while (dataSize < size) {
+		dataSize <<= 1;
+	}
+
+	ring->mapSize = sizeof(ringHeader) + dataSize;
+	ring->memFD = memfd_create("logosnet-ring", MFD_CLOEXEC);
+	ring->eventFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ring->header = MAP_FAILED;
+
+	if (ring->memFD >= 0 && ring->eventFD >= 0 && ftruncate(ring->memFD, ring->mapSize) == 0) {
+		ring->header = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memFD, 0);
+	}
+	if (ring->header == MAP_FAILED) {
+		ring->header = NULL;
+		ringClose(ring);
+		return -1;
+	}
+
+	// ftruncate zeroed the rest
+	ring->header->version = RING_VERSION;
+	ring->header->size = dataSize;
+	__atomic_store_n(&ring->header->magic, RING_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int ringMap(ringStruct* ring, int memFD, int eventFD) {
+	struct stat info;
+
+	ring->memFD = memFD;
+	ring->eventFD = eventFD;
+	ring->header = NULL;
+
+	if (fstat(memFD, &info) < 0 || info.st_size < (off_t)sizeof(ringHeader)) {
+		ringClose(ring);
+		return -1;
+	}
+
+	ring->mapSize = info.st_size;
+	ring->header = mmap(NULL, ring->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFD, 0);
+	if (ring->header == MAP_FAILED) {
+		ring->header = NULL;
+		ringClose(ring);
+		return -1;
+	}
+
+	// The size has to match what we mapped, or copies run off the end
+	if (__atomic_load_n(&ring->header->magic, __ATOMIC_ACQUIRE) != RING_MAGIC || ring->header->version != RING_VERSION
+			|| sizeof(ringHeader) + (uint64_t)ring->header->size != ring->mapSize || (ring->header->size & (ring->header->size - 1))) {
+		ringClose(ring);
+		return -1;
+	}
+	return 0;
+}
+
+void ringClose(ringStruct* ring) {
+	if (ring->header) {
+		munmap(ring->header, ring->mapSize);
+		ring->header = NULL;
+	}
+	if (ring->memFD >= 0) {
+		close(ring->memFD);
+		ring->memFD = -1;
+	}
+	if (ring->eventFD >= 0) {
+		close(ring->eventFD);
+		ring->eventFD = -1;
+	}
+}
+
+int ringPut(ringStruct* ring, const void* frame, uint16_t size) {
+	ringHeader* header = ring->header;
+	uint64_t head = header->head;
+	uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (head - tail + size > header->size) {
+		return -1;
+	}
+
+	copyIn(header, head, frame, size);
+
+	// Publish, then look for a sleeper. Both sequentially consistent, so
+	// either we see waiting or the consumer sees the new head.
+	__atomic_store_n(&header->head, head + size, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&header->waiting, __ATOMIC_SEQ_CST)) {
+		return 0;
+	}
+
+	__atomic_store_n(&header->waiting, 0, __ATOMIC_RELAXED);
+	if (write(ring->eventFD, &one, sizeof(one)) < 0) {
+		// Already signalled and not read yet, it's awake either way
+	}
+	return 1;
+}
+
+int ringGet(ringStruct* ring, char* buffer, int bufferSize) {
+	ringHeader* header = ring->header;
+	uint64_t tail = header->tail;
+	uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	uint16_t size;
+
+	if (head == tail) {
+		return -1;
+	}
+
+	copyOut(header, tail, (char*)&size, sizeof(uint16_t));
+
+	// Too big for the caller, it gets what fits
+	copyOut(header, tail + sizeof(uint16_t), buffer, (size < bufferSize) ? size : bufferSize);
+
+	__atomic_store_n(&header->tail, tail + sizeof(uint16_t) + size, __ATOMIC_RELEASE);
+	return (size < bufferSize) ? size : bufferSize;
+}
+
+int ringSleep(ringStruct* ring) {
+	ringHeader* header = ring->header;
+
+	__atomic_store_n(&header->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) != header->tail) {
+		__atomic_store_n(&header->waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+void ringWoken(ringStruct* ring) {
+	uint64_t count;
+
+	if (read(ring->eventFD, &count, sizeof(count)) < 0) {
+		// Woken for something else, nothing to reset
+	}
+	__atomic_store_n(&ring->header->waiting, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,68 @@
+#ifndef PROG3_RING_H
+#define PROG3_RING_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------
+* Shared-memory ring for observers on the same host.
+*
+* The server is the only producer and the observer the only consumer.
+* Frames are copied in exactly as they would go on the wire (uint16 size,
+* then the body) and may wrap around the end of the data area. head and
+* tail are free-running byte counts on cache lines of their own; each
+* side only ever writes its own.
+*
+* The memory is a memfd and the wakeup an eventfd, both handed to the
+* observer over its Unix socket. The consumer sets waiting before it
+* sleeps and checks the ring once more; the producer only writes the
+* eventfd if it sees waiting after publishing head. So a busy consumer
+* costs the server nothing but the copy.
+*
+* A producer that finds no room never waits: the server either drops the
+* observer or drops the frame and counts it in lost, see -Z.
+*------------------------------------------------------------------------
+*/
+
+#define RING_MAGIC 0x474e4952 /* "RING" */
+#define RING_VERSION 1
+
+typedef struct ringHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; /* bytes of data, a power of two */
+	uint32_t waiting; /* consumer is about to sleep on the eventfd */
+	uint64_t lost; /* frames dropped because the ring was full */
+	_Alignas(64) uint64_t head; /* bytes written, producer only */
+	_Alignas(64) uint64_t tail; /* bytes read, consumer only */
+	_Alignas(64) char data[];
+} ringHeader;
+
+typedef struct ringStruct {
+	ringHeader* header;
+	uint64_t mapSize;
+	int memFD;
+	int eventFD;
+} ringStruct;
+
+// Producer: a new ring of at least size bytes. -1 on failure
+int ringCreate(ringStruct* ring, uint32_t size);
+
+// Map a ring someone else created, taking over both descriptors. -1 on failure
+int ringMap(ringStruct* ring, int memFD, int eventFD);
+
+void ringClose(ringStruct* ring);
+
+// Producer: copies one frame in. -1 = no room, 0 = done, 1 = done and woke the consumer
+int ringPut(ringStruct* ring, const void* frame, uint16_t size);
+
+// Consumer: copies the next frame's body out. Returns its size, -1 if the ring is empty
+int ringGet(ringStruct* ring, char* buffer, int bufferSize);
+
+// Consumer: announce we're going to sleep. 1 = wait for the eventfd,
+// 0 = something arrived meanwhile, read again
+int ringSleep(ringStruct* ring);
+
+// Consumer: the eventfd was readable
+void ringWoken(ringStruct* ring);
+
+#endif
@@ -0,0 +1,214 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "prog3_search.h"
+
+#define SEARCH_TERMS 16 /* tokens in one query */
+
+// Next token in text from *offset, folded into token. Returns its length, 0 at the end
+static int nextToken(const char* text, int size, int* offset, char* token) {
+	int length = 0;
+
+	while (*offset < size && !isalnum((unsigned char)text[*offset]) && text[*offset] != '_') {
+		(*offset)++;
+	}
+	while (*offset < size && (isalnum((unsigned char)text[*offset]) || text[*offset] == '_')) {
+		if (length < SEARCH_TOKEN_MAX) {
+			token[length++] = tolower((unsigned char)text[*offset]);
+		}
+		(*offset)++;
+	}
+	return length;
+}
+
+// FNV-1a
+static uint32_t hashToken(const char* token, int length) {
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)token[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// The entry for token, or NULL. With link, also where it is linked from
+static searchToken* findToken(searchIndex* index, const char* token, int length, searchToken*** link) {
+	searchToken** at = &index->buckets[hashToken(token, length) & (SEARCH_BUCKETS - 1)];
+
+	while (*at && ((*at)->length != length || memcmp((*at)->text, token, length))) {
+		at = &(*at)->next;
+	}
+	if (link) {
+		*link = at;
+	}
+	return *at;
+}
+
+// Appends id to token's postings, once per message
+static void post(searchIndex* index, const char* token, int length, uint64_t id) {
+	searchToken** link;
+	searchToken* entry = findToken(index, token, length, &link);
+
+	if (!entry) {
+		entry = calloc(1, sizeof(searchToken));
+		if (!entry) {
+			return;
+		}
+		entry->length = length;
+		memcpy(entry->text, token, length);
+		*link = entry;
+		index->tokens++;
+	}
+
+	// Already there from earlier in the same message
+	if (entry->count && entry->ids[entry->start + entry->count - 1] == id) {
+		return;
+	}
+
+	// Evictions leave room at the front, use it before growing
+	if (entry->start + entry->count == entry->capacity) {
+		if (entry->start && entry->start >= entry->capacity / 2) {
+			memmove(entry->ids, entry->ids + entry->start, entry->count * sizeof(uint64_t));
+			entry->start = 0;
+		} else {
+			uint32_t capacity = entry->capacity ? entry->capacity * 2 : 4;
+			uint64_t* ids = realloc(entry->ids, capacity * sizeof(uint64_t));
+
+			if (!ids) {
+				return;
+			}
+			entry->ids = ids;
+			entry->capacity = capacity;
+		}
+	}
+	entry->ids[entry->start + entry->count++] = id;
+}
+
+// The message leaving the window is the oldest in every list it is in
+static void unpost(searchIndex* index, const char* token, int length, uint64_t id) {
+	searchToken** link;
+	searchToken* entry = findToken(index, token, length, &link);
+
+	if (!entry || !entry->count || entry->ids[entry->start] != id) {
+		return;
+	}
+
+	entry->start++;
+	if (--entry->count == 0) {
+		*link = entry->next;
+		free(entry->ids);
+		free(entry);
+		index->tokens--;
+	}
+}
+
+// Whether the ascending list holds id
+static int holds(searchToken* entry, uint64_t id) {
+	uint64_t* ids = entry->ids + entry->start;
+	uint32_t low = 0;
+	uint32_t high = entry->count;
+
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+
+		if (ids[middle] < id) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < entry->count && ids[low] == id;
+}
+
+int searchInit(searchIndex* index, uint32_t window) {
+	index->window = window;
+	index->lastId = 0;
+	index->tokens = 0;
+	index->messages = calloc(window, sizeof(searchMessage));
+	index->buckets = calloc(SEARCH_BUCKETS, sizeof(searchToken*));
+
+	if (!index->messages || !index->buckets) {
+		free(index->messages);
+		free(index->buckets);
+		return -1;
+	}
+	return 0;
+}
+
+void searchAdd(searchIndex* index, const char* message, uint16_t size) {
+	uint64_t id = ++index->lastId;
+	searchMessage* slot = &index->messages[id % index->window];
+	char token[SEARCH_TOKEN_MAX];
+	struct timespec now;
+	int offset = 0;
+	int length;
+
+	// Make room first
+	if (slot->id) {
+		while ((length = nextToken(slot->text, slot->size, &offset, token))) {
+			unpost(index, token, length, slot->id);
+		}
+		free(slot->text);
+		slot->id = 0;
+	}
+
+	slot->text = malloc(size);
+	if (!slot->text) {
+		return;
+	}
+	memcpy(slot->text, message, size);
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->id = id;
+	slot->at = now.tv_sec * 1000000000ull + now.tv_nsec;
+	slot->size = size;
+
+	offset = 0;
+	while ((length = nextToken(message, size, &offset, token))) {
+		post(index, token, length, id);
+	}
+}
+
+int searchQuery(searchIndex* index, const char* query, searchMessage** results, int max) {
+	searchToken* terms[SEARCH_TERMS];
+	char token[SEARCH_TOKEN_MAX];
+	int numTerms = 0;
+	int shortest = 0;
+	int offset = 0;
+	int matches = 0;
+	int length;
+
+	while (numTerms < SEARCH_TERMS && (length = nextToken(query, strlen(query), &offset, token))) {
+		terms[numTerms] = findToken(index, token, length, NULL);
+
+		// A term no message has, nothing can match
+		if (!terms[numTerms]) {
+			return 0;
+		}
+		if (terms[numTerms]->count < terms[shortest]->count) {
+			shortest = numTerms;
+		}
+		numTerms++;
+	}
+	if (numTerms == 0) {
+		return 0;
+	}
+
+	for (uint32_t i = terms[shortest]->count; i > 0; i--) {
+		uint64_t id = terms[shortest]->ids[terms[shortest]->start + i - 1];
+		int t;
+
+		for (t = 0; t < numTerms && (t == shortest || holds(terms[t], id)); t++) {
+		}
+		if (t < numTerms) {
+			continue;
+		}
+
+		if (matches < max) {
+			results[matches] = &index->messages[id % index->window];
+		}
+		matches++;
+	}
+	return matches;
+}
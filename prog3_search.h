@@ -0,0 +1,60 @@
+#ifndef PROG3_SEARCH_H
+#define PROG3_SEARCH_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------
+* Inverted index over the most recent messages.
+*
+* Messages are kept in a window of a fixed number of slots, each with an
+* id that only ever grows. Every distinct token of a message (letters,
+* digits and '_', folded to lower case, at most SEARCH_TOKEN_MAX bytes)
+* gets the id appended to its postings list, so the lists stay sorted.
+* When a message falls out of the window its id is at the front of each
+* of its tokens' lists and is popped off again; a token with no messages
+* left is freed. Adding and evicting cost one hash lookup per token.
+*
+* A query is a list of tokens that must all appear. The shortest list is
+* walked newest first and the others are binary searched.
+*------------------------------------------------------------------------
+*/
+
+#define SEARCH_TOKEN_MAX 32
+#define SEARCH_BUCKETS 65536 /* a power of two */
+
+typedef struct searchToken {
+	struct searchToken* next; /* same bucket */
+	uint64_t* ids; /* postings, oldest first, from start */
+	uint32_t start;
+	uint32_t count;
+	uint32_t capacity;
+	uint8_t length;
+	char text[SEARCH_TOKEN_MAX];
+} searchToken;
+
+typedef struct searchMessage {
+	uint64_t id; /* 0 if the slot was never used */
+	uint64_t at; /* CLOCK_REALTIME nanoseconds */
+	uint16_t size;
+	char* text;
+} searchMessage;
+
+typedef struct searchIndex {
+	uint32_t window; /* messages kept */
+	uint64_t lastId;
+	uint32_t tokens; /* distinct tokens in the window */
+	searchMessage* messages; /* by id % window */
+	searchToken** buckets;
+} searchIndex;
+
+// An index over the last window messages. -1 on failure
+int searchInit(searchIndex* index, uint32_t window);
+
+// Indexes a message, evicting the oldest if the window is full
+void searchAdd(searchIndex* index, const char* message, uint16_t size);
+
+// Messages holding every token in query, newest first. Up to max of them
+// go in results; returns how many match in all.
+int searchQuery(searchIndex* index, const char* query, searchMessage** results, int max);
+
+#endif
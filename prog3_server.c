@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +10,65 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 
-#define QLEN 6 /* size of request queue */
+#include "prog3_log.h"
+#include "prog3_proto.h"
+#include "prog3_ring.h"
+#include "prog3_search.h"
+#include "prog3_stats.h"
+#include "prog3_timer.h"
+#include "prog3_trace.h"
+
+#define QLEN 128 /* default size of request queue, -b overrides */
 #define MAX_CLIENTS 255 /* Max number of participants & clients */
+#define MAX_MESSAGE 1000 /* largest message a participant may send */
+#define ACCEPT_BUDGET 64 /* connections accepted per listener per wakeup */
+#define FRAME_BUDGET 16 /* frames read from one connection per wakeup */
+#define SEND_TIMEOUT_MS 5000 /* longest a send waits on a stalled peer */
+#define NS_PER_SEC 1000000000ull
+#define HANDSHAKE_TIMEOUT 10 /* seconds to send a username, the clients' own limit */
+#define KEEPALIVE_INTERVAL 10 /* seconds between pings */
+#define KEEPALIVE_MISSES 2 /* unanswered pings before a peer is dropped */
+#define MAX_ADMINS 8 /* Max number of concurrent stats requests */
+#define LANE_CONTROL 0 /* presence announcements, notices, pings */
+#define LANE_BULK 1 /* chat */
+#define LANES 2
+#define LANE_BURST 8 /* control frames sent in a row while bulk waits */
+#define WRITE_BATCH 64 /* frames handed to one writev */
+#define OUT_QUEUE_MAX (256 * 1024) /* bytes queued for one peer before it is dropped */
+#define HANDOFF_MAGIC 0x46464f48 /* "HOFF" */
+#define HANDOFF_VERSION 10 /* bump when handoffRecord changes */
+#define HANDOFF_TIMEOUT_MS 5000 /* longest either side waits on the other */
+#define HANDOFF_CHUNK 8192 /* queued output per HANDOFF_QUEUE record, more than any frame */
+#define MAX_NODES 16 /* other servers in the federation */
+#define MAX_REPLICAS 16 /* read-only servers subscribed to us */
+#define MAX_DIRECTORY (MAX_CLIENTS * MAX_NODES) /* usernames living on other nodes */
+#define NODE_RETRY_MS 1000 /* between attempts to dial a node that is down */
+#define NODE_HEADER 17 /* type, lane, username[11], int32 arg */
+#define MAX_FRAME (NODE_HEADER + MAX_MESSAGE + 14) /* node frames carry formatted messages */
+#define FEED_HISTORY 4096 /* public messages kept for repairs, a power of two */
+#define FEED_HEARTBEAT_MS 1000
+#define FEED_NACK_MAX 64 /* messages resent for one NACK */
+#define MAX_GATEWAYS 16
+#define MAX_VIRTUAL 4096 /* usernames registered through gateways, all together */
+#define FRAME_POOL_IDLE 256 /* receive buffers kept for reuse, more are freed */
+#define DIGEST_NAMES 900 /* bytes of names in one presence digest, the rest are counted */
+#define ROSTER_HISTORY 1024 /* changes kept for clients catching up, a power of two */
+#define ROSTER_FRAME 1000 /* largest roster update, clients read messages this big */
+#define SEARCH_RESULTS 50 /* newest matches returned by a search */
 
 const char n = 'N';
 const char y = 'Y';
@@ -24,20 +80,271 @@ const char t = 'T';
 * Purpose: allocate a socket and then repeatedly execute the following:
 *
 *
-* Syntax: ./prog3_server parPort obsPort
+* Syntax: ./prog3_server [-a adminPort] [-m statsName] [-t tracePrefix] [-l level]
+*                        [-b backlog] [-r rate] [-p policy] [-h seconds]
+*                        [-i seconds] [-k seconds] [-L] [-P nodePort]
+*                        [-n nodeId] [-N id=host:port]... [-R host:port]
+*                        [-U parPath] [-O obsPath] [-z bytes] [-Z policy]
+*                        [-M group:port] [-I address] [-g token] [-c ms]
+*                        [-s messages] parPort obsPort
 *
 * port - protocol port number to use
+* adminPort - localhost port serving plain text statistics
+* statsName - shared memory segment for chatstat (default /logosnet.parPort)
+* tracePrefix - SIGUSR2 dumps the event trace to tracePrefix.pid.N
+*               (default /tmp/logosnet-trace)
+* level - log level: error, warn, info or debug (default info)
+* backlog - listen queue length for both ports (default 128)
+* rate - per participant limit "messages[:bytes]" per second (default none)
+* policy - what happens over the limit: delay (stop reading) or reject
+*          (drop with a notice to the sender's observer), default delay
+* -h - seconds a new participant or observer has to send a username
+*      (default 10, 0 = forever)
+* -i - seconds a participant may stay silent before being dropped
+*      (default 0 = forever)
+* -k - seconds between keepalive pings (default 10, 0 = off). Peers that
+*      miss 2 in a row are dropped; clients without ping support get
+*      TCP keepalives on the same schedule instead.
+* -L - on SIGHUP hand over only the listening sockets, the connected
+*      clients are dropped (default hands over everyone)
+* -P - port other servers link to (federation)
+* -n - this server's node id, 1 or more, unique in the federation
+* -N - another node, repeated for each one. The node with the lower id
+*      dials the higher one. Public messages reach every node once,
+*      private messages and observers go to the node the username lives on.
+* -R - run as a read-only replica of the server whose -P port is given:
+*      participants are turned away, observers are served from the
+*      primary's message stream
+* -U, -O - also listen for participants / observers on a Unix socket at
+*      this path, for clients on the same host. Same protocol as the ports.
+* -z - observers on the Unix socket may read from a shared-memory ring of
+*      this many bytes instead of the socket (default 0 = off)
+* -Z - what happens when a ring is full: close (drop the observer, the
+*      default) or drop (lose the message, the observer sees a count)
+* -M - also publish public messages to this multicast group, repairs are
+*      asked for on port + 1 (see prog3_proto.h)
+* -I - local address of the interface to multicast from (default: routing)
+* -g - participants that send this token may act as gateways, one
+*      connection for many usernames (see prog3_proto.h)
+* -c - collect joins and leaves for this many milliseconds and announce
+*      them in one message (default 0 = each on its own)
+* -s - index this many of the latest public messages for "search" on the admin
+*      port (default 0 = off)
+*
+* SIGHUP execs the server binary again and hands it the listening sockets
+* and every client over a Unix socket, then exits. The new process gets
+* "-X fd" ahead of the original arguments to find the handoff channel.
 *
 *------------------------------------------------------------------------
 */
 
+// Tokens are scaled by NS_PER_SEC so refills stay in integer math
+typedef struct tokenBucket {
+	uint64_t tokens;
+	uint64_t refilledAt;
+} tokenBucket;
+
 typedef struct participantStruct {
 	int parSD;
 	char username[11];
 	int active; /* 0 is inactive, 1 is active */
 	int obsSD;
+	tokenBucket messageBucket;
+	tokenBucket byteBucket;
+	uint64_t heldUntil; /* delayed message waiting for tokens, 0 if none */
+	uint64_t heldSince;
+	timerStruct holdTimer; /* releases the held message */
+	uint64_t lastNotice; /* last rate limit notice sent */
+	int obsNode; /* node our observer is attached through, -1 if none */
+	int duplex; /* parSD also gets what an observer would, see PROTO_CAP_DUPLEX */
 } participantStruct;
 
+// One framed message, shared by every connection it is queued on
+typedef struct msgBlock {
+	int refs;
+	uint16_t size; /* including the size prefix */
+	uint64_t receivedAt; /* ingress time, 0 for server notices */
+	char data[];
+} msgBlock;
+
+typedef struct outEntry {
+	struct outEntry* next;
+	msgBlock* block;
+} outEntry;
+
+typedef struct outLane {
+	outEntry* head;
+	outEntry* tail;
+} outLane;
+
+// Per socket receive state, sockets are non-blocking so frames arrive in pieces.
+// Output waits in priority lanes until the socket has room for it.
+typedef struct connStruct {
+	int sd;
+	int headerRead; /* bytes of the size prefix received */
+	uint8_t header[2];
+	uint16_t frameSize;
+	uint16_t bytesRead; /* bytes of the frame body received */
+	char* frame; /* MAX_FRAME + 1 from the pool while a frame arrives, else NULL */
+	uint16_t maxFrame; /* larger frames are an error */
+	int control; /* the frame is a control frame, see prog3_proto.h */
+	uint8_t caps; /* negotiated by a hello */
+	int pingsOutstanding;
+	timerStruct timer; /* username deadline, then idle timeout */
+	timerStruct keepaliveTimer;
+	outLane lanes[LANES];
+	outEntry* partial; /* frame on the wire, taken off its lane */
+	int sent; /* bytes of partial already written */
+	int queued; /* bytes waiting in total */
+	int burst; /* control frames sent since the last bulk one */
+	int attachNode; /* pending observer waiting on a node's answer, node index + 1 */
+	ringStruct* ring; /* same-host observer reading shared memory instead, NULL if not */
+	int roster; /* asked for the roster, gets every change from then on */
+} connStruct;
+
+// Server to server frames: the usual uint16 size, then NODE_HEADER bytes
+// (type, lane, username, int32 arg) and the body
+enum nodeType {
+	NODE_HELLO = 1, /* arg = sender's node id */
+	NODE_JOIN,      /* username now lives on the sender */
+	NODE_LEAVE,     /* username is free again */
+	NODE_PUBLIC,    /* body goes to every observer */
+	NODE_PRIVATE,   /* body goes to the observer of username, who lives on the receiver */
+	NODE_DELIVER,   /* body goes to the observer of username, attached on the receiver */
+	NODE_ATTACH,    /* an observer for username, arg = its descriptor on the sender */
+	NODE_ATTACHED,  /* answer to NODE_ATTACH, body = 'Y', 'N' or 'T' */
+	NODE_DETACH,    /* the observer of username on the sender is gone */
+	NODE_SUBSCRIBE  /* a replica's hello, it gets JOIN, LEAVE and PUBLIC from then on */
+};
+
+// What a node is to us
+#define ROLE_PEER 0 /* part of the federation mesh */
+#define ROLE_REPLICA 1 /* subscribed to us */
+#define ROLE_PRIMARY 2 /* we are its replica */
+
+// broadcastNodes targets
+#define TO_PEERS 1
+#define TO_REPLICAS 2
+
+typedef struct nodeStruct {
+	int id;
+	struct sockaddr_in address;
+	int sd; /* -1 while down */
+	int connecting; /* our non-blocking connect is in progress */
+	int up; /* hellos exchanged */
+	int role;
+	timerStruct retryTimer;
+} nodeStruct;
+
+// Observer here for a participant on another node
+typedef struct remoteObserver {
+	int sd; /* 0 if the slot is free */
+	char username[11];
+	int node;
+} remoteObserver;
+
+// Username registered through a gateway, its traffic goes over the gateway's connection
+typedef struct virtualUser {
+	char username[11]; /* empty if the slot is free */
+	int gateway; /* the gateway's descriptor */
+	uint16_t id; /* what the gateway calls it */
+} virtualUser;
+
+// Joins or leaves waiting to be announced together, see -c
+typedef struct presenceDigest {
+	int count; /* users in this window */
+	int listed; /* those whose names fit */
+	int size;
+	char names[DIGEST_NAMES + 1];
+} presenceDigest;
+
+// One step of the roster, kept so clients can catch up from a version
+typedef struct rosterStep {
+	uint64_t version; /* the roster's version after this change */
+	char op; /* PROTO_ROSTER_ADD or PROTO_ROSTER_REMOVE */
+	char username[11];
+} rosterStep;
+
+// Which node a username we don't have lives on
+typedef struct directoryEntry {
+	char username[11]; /* empty if the slot is free */
+	int node;
+} directoryEntry;
+
+// Hot restart wire format. Explicit fields rather than our own structs,
+// so a new binary can check the version before trusting the layout.
+enum handoffType {
+	HANDOFF_LISTENERS = 1, /* fds: parListenSD, obsListenSD, then each one of adminSD, nodeListenSD,
+	                          unixParListenSD, unixObsListenSD, feedSD whose has flag is set */
+	HANDOFF_PARTICIPANT,   /* fds: parSD, obsSD if hasObserver, ring memfd and eventfd if obsRing */
+	HANDOFF_PENDING,       /* fds: observer still sending its username */
+	HANDOFF_GATEWAY,       /* fds: gateway, its users follow as HANDOFF_VIRTUAL */
+	HANDOFF_VIRTUAL,       /* no fds, username and virtualId of the last gateway's user */
+	HANDOFF_NODE,          /* fds: the link to node, once hellos are exchanged */
+	HANDOFF_PENDING_NODE,  /* fds: a node that dialled in and has not said hello yet */
+	HANDOFF_DIRECTORY,     /* no fds, username lives on node */
+	HANDOFF_REMOTE_OBSERVER, /* fds: observer of username on node, ring memfd and eventfd if obsRing */
+	HANDOFF_QUEUE,         /* no fds, output still queued on a connection of the last record */
+	HANDOFF_END
+};
+
+typedef struct handoffConn {
+	int32_t headerRead;
+	uint8_t header[2];
+	uint16_t frameSize;
+	uint16_t bytesRead;
+	uint8_t caps;
+	uint8_t roster;
+	int32_t attachNode;
+	char frame[MAX_FRAME]; /* node frames are the largest */
+} handoffConn;
+
+typedef struct handoffRecord {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;
+	int32_t hasAdmin;
+	int32_t hasNodes;
+	int32_t hasUnixParticipants;
+	int32_t hasUnixObservers;
+	int32_t hasFeed;
+	uint64_t feedSequence; /* receivers see the numbers carry on */
+	uint64_t rosterVersion; /* the history stays behind, clients get a full roster */
+	char username[11];
+	int32_t active;
+	int32_t hasObserver;
+	int32_t obsRing;
+	int32_t duplex;
+	int32_t virtualId;
+	int32_t obsNode;
+	int32_t node; /* index into nodes, the same on both sides for configured ones */
+	int32_t nodeId;
+	int32_t nodeRole;
+	uint64_t messageTokens;
+	uint64_t messageRefilledAt;
+	uint64_t byteTokens;
+	uint64_t byteRefilledAt;
+	uint64_t heldUntil; /* CLOCK_MONOTONIC is system wide, so these carry over as is */
+	uint64_t heldSince;
+	uint64_t lastNotice;
+	handoffConn par; /* pending observers use this one */
+	handoffConn obs;
+	int32_t queueFor; /* 0 = par, 1 = obs */
+	int32_t queueLane; /* -1 for the rest of the frame already on the wire */
+	int32_t queueSize;
+	char queue[HANDOFF_CHUNK]; /* whole frames, or the rest of one */
+} handoffRecord;
+
+typedef struct adminStruct {
+	int sd;
+	int length;
+	char request[256];
+	char* response; /* answer being sent, NULL while the request comes in */
+	int responseSize;
+	int responseSent;
+	timerStruct timer; /* gives up on a reader that stops draining */
+} adminStruct;
+
 // New Clients
 int handleNewParticipant(int sd);
 int handleNewObserver(int sd);
@@ -47,55 +354,427 @@ int handleParticipantDisconnect(int i);
 int handleObserverDisconnect(int i);
 
 // Messaging
-int handlePublicMessages(char message[], uint16_t messageSize);
+int handlePublicMessages(char message[], uint16_t messageSize, int lane);
+int deliverPublic(char message[], uint16_t messageSize, int lane);
 int handlePrivateMessages(char message[], uint16_t messageSize, int sender);
+int routePrivate(char message[], uint16_t messageSize, char* username);
 int handleNewMessage(int i);
+void announcePresence(const char* username, int left, int local);
+void flushPresence(void* arg);
+
+// Roster
+void rosterChange(const char* username, int left);
+void rosterRequest(connStruct* conn);
+int rosterAppend(connStruct* conn, char* frame, int* size, uint8_t* flags, char op, const char* username);
+int rosterSend(connStruct* conn, char* frame, int size, uint8_t flags);
 
 // I/O
-int sendMessage(int parID, char* message, uint16_t messageSize);
-int receiveUsername(int index, char message[], uint8_t* size, int exists);
+int sendMessage(int parID, char* message, uint16_t messageSize, int lane);
+int sendReply(connStruct* conn, const void* reply, int size);
+void rejectConnection(connStruct* conn, char reply);
+
+// Output Queues
+msgBlock* newBlock(const char* message, uint16_t messageSize, int control);
+void releaseBlock(msgBlock* block);
+int queueObserver(int parID, msgBlock* block, int lane);
+int queueFrame(connStruct* conn, msgBlock* block, int lane);
+int flushConnection(connStruct* conn);
+int pickLane(outEntry* control, outEntry* bulk, int burst);
+outEntry* nextFrame(connStruct* conn);
+int discardQueue(connStruct* conn);
+int readFrame(connStruct* conn, int headerSize);
+char* borrowFrame();
+void returnFrame(connStruct* conn);
+int handleParticipantInput(int i);
+int handleObserverInput(int i);
+int readObserver(connStruct* conn);
+
+// Rate Limiting
+uint64_t takeTokens(participantStruct* participant, int size, uint64_t now);
+uint64_t refillBucket(tokenBucket* bucket, uint64_t rate, uint64_t capacity, uint64_t now);
+void releaseHeldMessage(void* arg);
+
+// Timeouts
+void armTimeout(connStruct* conn, int seconds);
+void connectionTimedOut(void* arg);
+
+// Keepalive
+int handleHello(connStruct* conn, int participant);
+int handleControlFrame(connStruct* conn);
+void startKeepalive(connStruct* conn);
+void sendPing(void* arg);
+void reapConnection(connStruct* conn);
+
+// Shared-memory Rings
+int startRing(connStruct* conn);
+int ringDeliver(connStruct* conn, msgBlock* block);
+
+// Multicast Feed
+int openFeed(char* group, char* interface);
+void feedPublish(msgBlock* block);
+int feedSend(uint64_t sequence, msgBlock* block, struct sockaddr_in* to);
+void feedHeartbeat(void* arg);
+int handleFeedRepair();
+
+// Gateways
+int startGateway(int i);
+int handleGatewayInput(int g);
+int handleGatewayControl(int g);
+int handleGatewayMessage(int g);
+void handleGatewayDisconnect(int g);
+void unregisterVirtual(int v);
+int sendVirtual(int v, char* message, uint16_t messageSize, int lane);
+msgBlock* newTaggedBlock(uint16_t id, const char* message, uint16_t messageSize, int control);
+int queueGateway(int sd, msgBlock* block, int lane);
+int getVirtualByName(char* username);
+int getVirtualById(int sd, uint16_t id);
+
+// Connections
+int acceptConnections(int listenSD, int observer);
+connStruct* openConnection(int sd);
+void shedConnection(int listenSD);
+void closeConnection(int sd);
 
 // Helper Functions
 int handleNewUsername(int i);
 int checkUsername(char username[]);
 int addParticpant(participantStruct* participant);
 int getParticipantByName(char* username);
+int getParticipantBySD(int sd);
 void resetFdSet(int sd, int sd2);
 int connectObserver(int i);
 
+// Hot Restart
+void hotRestart();
+int sendHandoff(int channel);
+int receiveHandoff(int channel);
+int sendRecord(int channel, handoffRecord* record, int* fds, int count);
+int receiveRecord(int channel, handoffRecord* record, int* fds, int* count);
+int waitChannel(int channel, char expected);
+int sendQueue(int channel, connStruct* conn, int which);
+int restoreQueue(connStruct* conn, handoffRecord* record);
+void packConn(handoffConn* packed, connStruct* conn);
+connStruct* unpackConn(handoffConn* packed, int sd);
+void handleRestartSignal(int signal);
+
+// Federation
+int addNode(char* spec, int role);
+void dialNode(void* arg);
+void nodeConnected(int k);
+void nodeUp(int k);
+void nodeDown(int k);
+int acceptNode(int listenSD);
+int handlePendingNode(int p);
+int handleNodeInput(int k);
+void handleNodeFrame(int k, char* frame, uint16_t size);
+void nodeJoin(int k, char* username);
+void nodeLeave(int k, char* username);
+void nodeAttach(int k, char* username, int32_t sd);
+void nodeAttached(int k, char* username, int32_t sd, char result);
+msgBlock* newNodeBlock(int type, int lane, const char* username, int32_t arg, const char* body, uint16_t bodySize);
+int sendNode(int k, int type, int lane, const char* username, int32_t arg, const char* body, uint16_t bodySize);
+void broadcastNodes(int to, int type, int lane, const char* username, const char* body, uint16_t bodySize);
+int queueNode(int k, msgBlock* block, int lane);
+int queueRemoteObserver(int r, msgBlock* block, int lane);
+void handleRemoteObserverDisconnect(int r, int tell);
+int getRemoteObserver(char* username, int k);
+int directoryLookup(char* username);
+
+// Statistics
+int openListener(struct sockaddr_in* address, int protocol, int backlog);
+int openUnixListener(const char* path, int backlog);
+int openAdminSocket(int port, int backlog);
+int handleNewAdmin(int sd);
+int handleAdminRequest(int i);
+int flushAdmin(int i);
+void closeAdmin(int i);
+void adminTimeout(void* arg);
+int formatStats(char* buffer, int bufferSize);
+int formatSearch(char* query, int url, char* buffer, int bufferSize);
+int listenQueue(int sd);
+void publishStats();
+
 // Debug Printing
 void printParticipants();
 void printParticipant(participantStruct* participant);
+void printHistograms();
+void handleStatsSignal(int signal);
+void handleTraceSignal(int signal);
+void dumpTrace();
 
 int numParticipants = 0;
 int numObservers = 0;
 int maxSD = 0;
 participantStruct* participants[MAX_CLIENTS] = { NULL };
 fd_set fdSet;
+fd_set writeSet; /* connections with queued output */
 
 int unconObsSD[MAX_CLIENTS];
 
+// Refused connections, closed once the answer has gone out
+int closingSD[MAX_CLIENTS];
+
+// Receive state by socket descriptor, select keeps them below FD_SETSIZE
+connStruct* connections[FD_SETSIZE] = { NULL };
+int parListenSD = -1;
+int obsListenSD = -1;
+int unixParListenSD = -1; /* -U, -1 if not listening */
+int unixObsListenSD = -1; /* -O */
+int spareFD = -1; /* given up to shed a connection when out of descriptors */
+
+// Per participant limits, 0 = unlimited
+uint64_t messageRate = 0; /* messages per second */
+uint64_t byteRate = 0; /* bytes per second */
+int rejectOverLimit = 0; /* 0 = delay, 1 = reject */
+
+// Deadlines, in seconds, 0 = none
+int handshakeTimeout = HANDSHAKE_TIMEOUT;
+int idleTimeout = 0;
+int keepaliveInterval = KEEPALIVE_INTERVAL;
+timerWheel timers;
+
+// Same-host observer rings, 0 bytes = off
+uint32_t ringSize = 0;
+int ringDropOnOverrun = 0; /* 0 = close the observer, 1 = lose the message */
+
+// Receive buffers not lent to any connection
+char* framePool[FRAME_POOL_IDLE];
+int framePoolIdle = 0;
+int framesBorrowed = 0;
+
+// Gateways, off without a token
+char* gatewayToken = NULL;
+int gateways[MAX_GATEWAYS]; /* descriptors, 0 if the slot is free */
+virtualUser virtualUsers[MAX_VIRTUAL];
+int numGateways = 0;
+int numVirtual = 0;
+
+// Presence digests by [left][local], local ones stay off the federation
+int coalesceWindow = 0; /* milliseconds, 0 = announce right away */
+presenceDigest presence[2][2];
+timerStruct presenceTimer;
+
+// Who is online here and on other nodes. Changes are numbered from a
+// start that depends on when we started, so a version from another run
+// never looks like one of ours.
+uint64_t rosterVersion = 0;
+rosterStep rosterHistory[ROSTER_HISTORY];
+
+// Recent messages by token, for moderators on the admin port
+int searchWindow = 0; /* messages, 0 = off */
+searchIndex search;
+
+// Multicast feed, -1 when off. Sends to the group and takes NACKs.
+int feedSD = -1;
+struct sockaddr_in feedGroup;
+uint64_t feedSequence = 0; /* last one sent */
+msgBlock* feedHistory[FEED_HISTORY]; /* by sequence, for repairs */
+timerStruct feedTimer;
+
+// Admin port, -1 when disabled
+int adminSD = -1;
+adminStruct admins[MAX_ADMINS];
+serverCounters counters;
+statsSegment* statsShm = NULL;
+
+// Latency histograms, dumped to stdout on SIGUSR1
+histogram ingressHist; /* last byte of a message read -> send to an observer returned */
+histogram sendHist; /* time spent in one observer send */
+histogram loopHist; /* one pass of the event loop after select wakes */
+histogram rttHist; /* ping sent -> pong read */
+uint64_t messageReceivedAt = 0; /* ingress time of the message being delivered, 0 if none */
+volatile sig_atomic_t statsRequested = 0;
+
+// Event trace, dumped to a file on SIGUSR2
+char* tracePrefix = "/tmp/logosnet-trace";
+int traceDumps = 0;
+volatile sig_atomic_t traceRequested = 0;
+
+// Hot restart
+char** savedArgv; /* to exec ourselves again */
+int handoffListenersOnly = 0;
+volatile sig_atomic_t restartRequested = 0;
+
+// Federation, nodeId 0 = standalone
+int nodeId = 0;
+int nodeListenSD = -1;
+nodeStruct nodes[MAX_NODES + MAX_REPLICAS]; /* configured nodes first, then replicas as they subscribe */
+int numNodes = 0;
+int primaryNode = -1; /* replica mode, the node we subscribe to */
+int pendingNodeSD[MAX_NODES]; /* accepted, no hello yet */
+directoryEntry directory[MAX_DIRECTORY];
+remoteObserver remoteObservers[MAX_CLIENTS];
+
 int main(int argc, char **argv) {
 	struct protoent *ptrp; /* pointer to a protocol table entry */
   	struct sockaddr_in cad; /* structure to hold server's address */
   	struct sockaddr_in pad; /* structure to hold client's address */
 	struct sockaddr_in oad; /* structure to hold client's address */
+	struct sockaddr_in nad; /* structure to hold the federation address */
   	int sd, sd2;
-	socklen_t alen; /* length of address */
-	int optval = 1; /* boolean value when we set socket option */
 	int obsPort; /* protocol port number */
  	int parPort; /* protocol port number */
 	char buf[1011]; /* buffer for string the server sends */
 
 	struct sockaddr_in sad; /* structure to hold server's address */
 	int port; /* protocol port number */
+	int adminPort = -1; /* localhost statistics port */
+	char* statsName = NULL; /* shared memory statistics segment */
+	char defaultStatsName[32];
+	int opt;
+
+	int level = LOG_LEVEL_INFO;
+	int backlog = QLEN;
+	int handoffFD = -1; /* set when started by a hot restart */
+	int nodePort = -1; /* federation, other servers link here */
+	char* unixParPath = NULL; /* local participants */
+	char* unixObsPath = NULL; /* local observers */
+	char* feedGroupSpec = NULL; /* multicast group:port */
+	char* feedInterface = NULL;
+
+	savedArgv = argv;
+
+	while ((opt = getopt(argc, argv, "a:m:t:l:b:r:p:h:i:k:LX:P:n:N:R:U:O:z:Z:M:I:g:c:s:")) != -1) {
+		switch (opt) {
+			case 'a':
+				adminPort = atoi(optarg);
+				break;
+			case 'm':
+				statsName = optarg;
+				break;
+			case 't':
+				tracePrefix = optarg;
+				break;
+			case 'l':
+				level = logParseLevel(optarg);
+				if (level < 0) {
+					argc = 0;
+				}
+				break;
+			case 'b':
+				backlog = atoi(optarg);
+				if (backlog <= 0) {
+					argc = 0;
+				}
+				break;
+			case 'r':
+				messageRate = strtoull(optarg, &optarg, 10);
+				if (*optarg == ':') {
+					byteRate = strtoull(optarg + 1, NULL, 10);
+				}
+				break;
+			case 'p':
+				if (!strcmp(optarg, "reject")) {
+					rejectOverLimit = 1;
+				} else if (strcmp(optarg, "delay")) {
+					argc = 0;
+				}
+				break;
+			case 'h':
+				handshakeTimeout = atoi(optarg);
+				break;
+			case 'i':
+				idleTimeout = atoi(optarg);
+				break;
+			case 'k':
+				keepaliveInterval = atoi(optarg);
+				break;
+			case 'L':
+				handoffListenersOnly = 1;
+				break;
+			case 'X':
+				handoffFD = atoi(optarg);
+				break;
+			case 'P':
+				nodePort = atoi(optarg);
+				break;
+			case 'n':
+				nodeId = atoi(optarg);
+				break;
+			case 'N':
+				if (addNode(optarg, ROLE_PEER) < 0) {
+					argc = 0;
+				}
+				break;
+			case 'R':
+				if (primaryNode >= 0 || addNode(optarg, ROLE_PRIMARY) < 0) {
+					argc = 0;
+				}
+				break;
+			case 'U':
+				unixParPath = optarg;
+				break;
+			case 'O':
+				unixObsPath = optarg;
+				break;
+			case 'z':
+				ringSize = strtoul(optarg, NULL, 10);
+				if (ringSize > (1u << 30)) {
+					argc = 0;
+				}
+				break;
+			case 'Z':
+				if (!strcmp(optarg, "drop")) {
+					ringDropOnOverrun = 1;
+				} else if (strcmp(optarg, "close")) {
+					argc = 0;
+				}
+				break;
+			case 'M':
+				feedGroupSpec = optarg;
+				break;
+			case 'I':
+				feedInterface = optarg;
+				break;
+			case 'g':
+				gatewayToken = optarg;
+				break;
+			case 'c':
+				coalesceWindow = atoi(optarg);
+				break;
+			case 's':
+				searchWindow = atoi(optarg);
+				break;
+			default:
+				argc = 0;
+		}
+	}
 
-	if (argc != 3) {
+	if (argc - optind != 2) {
 		fprintf(stderr,"Error: Wrong number of arguments\n");
 		fprintf(stderr,"usage:\n");
-		fprintf(stderr,"./prog3_server parPort obsPort \n");
+		fprintf(stderr,"./prog3_server [-a adminPort] [-m statsName] [-t tracePrefix] [-l level] [-b backlog] [-r messages[:bytes]] [-p delay|reject] [-h seconds] [-i seconds] [-k seconds] [-L] [-P nodePort] [-n nodeId] [-N id=host:port]... [-R host:port] [-U parPath] [-O obsPath] [-z bytes] [-Z close|drop] [-M group:port] [-I address] [-g token] [-c ms] [-s messages] parPort obsPort \n");
+		exit(EXIT_FAILURE);
+	}
+
+	// A replica takes everything from its primary and serves no one but observers
+	if (primaryNode >= 0 && (numNodes > 1 || nodePort > 0)) {
+		fprintf(stderr,"Error: A replica (-R) cannot take -N or -P\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Every node needs an id of its own to know who dials whom
+	if (numNodes && primaryNode < 0 && nodeId <= 0) {
+		fprintf(stderr,"Error: Federation needs a node id (-n)\n");
 		exit(EXIT_FAILURE);
 	}
+	for (int k = 0; k < numNodes && primaryNode < 0; k++) {
+		if (nodes[k].id == nodeId) {
+			fprintf(stderr,"Error: Node %d is this server\n", nodeId);
+			exit(EXIT_FAILURE);
+		}
+		for (int other = 0; other < k; other++) {
+			if (nodes[other].id == nodes[k].id) {
+				fprintf(stderr,"Error: Node %d given twice\n", nodes[k].id);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	// Keep stdout writes off the event loop
+	if (logInit(level) < 0) {
+		fprintf(stderr, "Warning: Cannot start log writer, logging synchronously\n");
+	}
 
 	// Clear sockaddr structures
 	memset((char *)&pad, 0, sizeof(pad));
@@ -110,12 +789,12 @@ int main(int argc, char **argv) {
 	oad.sin_addr.s_addr = INADDR_ANY;
 
 	// Convert to binary
-  	parPort = atoi(argv[1]);
-	obsPort = atoi(argv[2]);
+  	parPort = atoi(argv[optind]);
+	obsPort = atoi(argv[optind + 1]);
 
 	// Test for illegal value
 	if (obsPort < 0 || parPort < 0) {
-    	fprintf(stderr,"Error: Bad port number %s\n",argv[1]);
+    	fprintf(stderr,"Error: Bad port number %s\n",argv[optind]);
 		exit(EXIT_FAILURE);
 	} else {
 		// Set port number. The data type is u_short
@@ -129,146 +808,352 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	// Create a socket with AF_INET as domain, protocol type as SOCK_STREAM, and protocol as ptrp->p_proto. This call returns a socket descriptor named sd.
-	sd = socket(AF_INET, SOCK_STREAM, ptrp->p_proto);
-	if (sd < 0) {
-		fprintf(stderr, "Error: Socket creation failed\n");
-		exit(EXIT_FAILURE);
+	// Deadlines need the wheel, handed over clients come with some
+	timerInit(&timers, nowNs());
+	rosterVersion = (uint64_t)time(NULL) << 32;
+	timerSet(&presenceTimer, flushPresence, NULL);
+
+	if (handoffFD >= 0) {
+		// Hot restart, the old process hands over its sockets
+		if (receiveHandoff(handoffFD) < 0) {
+			fprintf(stderr, "Error: Hot restart handoff failed\n");
+			exit(EXIT_FAILURE);
+		}
+		sd = parListenSD;
+		sd2 = obsListenSD;
+	} else {
+		sd = openListener(&pad, ptrp->p_proto, backlog);
+		sd2 = openListener(&oad, ptrp->p_proto, backlog);
+		parListenSD = sd;
+		obsListenSD = sd2;
 	}
-    sd2 = socket(AF_INET, SOCK_STREAM, ptrp->p_proto);
-    if (sd2 < 0) {
-		fprintf(stderr, "Error: Socket creation failed\n");
-		exit(EXIT_FAILURE);
+
+	// Reserve a descriptor so we can still accept-and-close when out of them
+	spareFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	// A dead peer must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	maxSD = (sd < maxSD) ? maxSD : sd;
+	maxSD = (sd2 < maxSD) ? maxSD : sd2;
+
+	// Co-located clients skip the TCP stack, a hot restart already has these
+	if (unixParPath && unixParListenSD < 0) {
+		unixParListenSD = openUnixListener(unixParPath, backlog);
 	}
+	if (unixObsPath && unixObsListenSD < 0) {
+		unixObsListenSD = openUnixListener(unixObsPath, backlog);
+	}
+	maxSD = (unixParListenSD < maxSD) ? maxSD : unixParListenSD;
+	maxSD = (unixObsListenSD < maxSD) ? maxSD : unixObsListenSD;
 
-	// Allow reuse of port - avoid "Bind failed" issues
-	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
-		fprintf(stderr, "Error Setting socket option failed\n");
+	// Multicast feed, the group address is needed even with a handed over socket
+	if (feedGroupSpec && openFeed(feedGroupSpec, feedInterface) < 0) {
+		fprintf(stderr,"Error: Bad multicast group %s\n", feedGroupSpec);
 		exit(EXIT_FAILURE);
 	}
+	maxSD = (feedSD < maxSD) ? maxSD : feedSD;
 
-  	if (setsockopt(sd2, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
-		fprintf(stderr, "Error Setting socket option failed\n");
+	// Starts out empty, a hot restart too
+	if (searchWindow > 0 && searchInit(&search, searchWindow) < 0) {
+		fprintf(stderr,"Error: Cannot index %d messages\n", searchWindow);
 		exit(EXIT_FAILURE);
 	}
 
-	// Bind a local address to the socket
-	if (bind(sd, (struct sockaddr*) &pad, sizeof(pad)) < 0) {
-		fprintf(stderr,"Error: Bind failed\n");
-		exit(EXIT_FAILURE);
+	if (adminPort > 0 && adminSD < 0) {
+		adminSD = openAdminSocket(adminPort, backlog);
+		maxSD = (adminSD < maxSD) ? maxSD : adminSD;
 	}
 
-	if (bind(sd2, (struct sockaddr*) &oad, sizeof(oad)) < 0) {
-		fprintf(stderr,"Error: Bind failed\n");
-		exit(EXIT_FAILURE);
+	// Federation, a hot restart already has the listener
+	if (nodePort > 0 && nodeListenSD < 0) {
+		memset((char *)&nad, 0, sizeof(nad));
+		nad.sin_family = AF_INET;
+		nad.sin_addr.s_addr = INADDR_ANY;
+		nad.sin_port = htons(nodePort);
+		nodeListenSD = openListener(&nad, ptrp->p_proto, backlog);
+	}
+	if (nodeListenSD >= 0) {
+		maxSD = (nodeListenSD < maxSD) ? maxSD : nodeListenSD;
 	}
 
-	// Specify size of request queue.
-	if (listen(sd, QLEN) < 0) {
-		fprintf(stderr,"Error: Listen failed\n");
-		exit(EXIT_FAILURE);
+	// Links come up in the background, the lower id dials, a replica dials its primary.
+	// A hot restart already has the ones that were up.
+	for (int k = 0; k < numNodes; k++) {
+		if (nodes[k].sd < 0 && (nodes[k].role == ROLE_PRIMARY || nodeId < nodes[k].id)) {
+			dialNode(&nodes[k]);
+		}
 	}
 
-  	if (listen(sd2, QLEN) < 0) {
-		fprintf(stderr,"Error: Listen failed\n");
-		exit(EXIT_FAILURE);
+	if (!statsName) {
+		snprintf(defaultStatsName, sizeof(defaultStatsName), STATS_NAME_FORMAT, parPort);
+		statsName = defaultStatsName;
+	}
+
+	// Statistics are optional, keep serving if shared memory is unavailable
+	statsShm = statsCreate(statsName);
+	if (!statsShm) {
+		logWarn("Cannot create statistics segment %s", statsName);
 	}
 
+	// Dump histograms on SIGUSR1. No SA_RESTART so select wakes up for it.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleStatsSignal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	// Dump the event trace on SIGUSR2
+	traceInit();
+	sa.sa_handler = handleTraceSignal;
+	sigaction(SIGUSR2, &sa, NULL);
 
-	maxSD = (sd < sd2) ? sd2 : sd;
+	// Hand everything to a freshly exec'd binary on SIGHUP
+	sa.sa_handler = handleRestartSignal;
+	sigaction(SIGHUP, &sa, NULL);
 
 	while (1) {
     	int ready;
+		uint64_t loopStart;
+
+		if (statsRequested) {
+			statsRequested = 0;
+			printHistograms();
+		}
+
+		if (traceRequested) {
+			traceRequested = 0;
+			dumpTrace();
+		}
+
+		if (restartRequested) {
+			restartRequested = 0;
+			hotRestart();
+		}
 
 		// Wait for socket with data to read
 		resetFdSet(sd, sd2);
 
-		printf("Max SD: %d\n", maxSD);
-		fflush(stdout);
+		logDebug("Max SD: %d", maxSD);
 
-    	ready = select(maxSD + 1, &fdSet, NULL, NULL, NULL);
+		// Sleep no longer than the next timer allows
+		struct timeval timeout;
+		int timeoutMs = timerTimeout(&timers, nowNs());
+
+		timeout.tv_sec = timeoutMs / 1000;
+		timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+    	ready = select(maxSD + 1, &fdSet, &writeSet, NULL, (timeoutMs < 0) ? NULL : &timeout);
+
+		// Interrupted by a signal, handled at the top of the loop
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
 
 		// Error with select
 		if (ready == -1) {
-			fprintf(stderr, "ERROR: Select returned -1.\n");
+			logError("Select returned -1.");
 			exit(EXIT_FAILURE);
 		}
 
-		// Nothing available to read
+		loopStart = nowNs();
+		traceRecord(TRACE_WAKE, -1, ready, 0);
+
+		// Deadlines, held messages
+		timerExpire(&timers, loopStart);
+
+		// Nothing available to read, only timers fired
 		if (!ready) {
-			printf("Nothing to read.\n");
-			continue;
+			logDebug("Nothing to read.");
 		}
 
 		// Check for data from participants
 		for (int i = 0; i < MAX_CLIENTS; i++) {
+			// Room for queued output
+			if (participants[i] && participants[i]->obsSD >= 0 && FD_ISSET(participants[i]->obsSD, &writeSet)) {
+				if (flushConnection(connections[participants[i]->obsSD]) < 0) {
+					handleObserverDisconnect(i);
+				}
+			}
+			if (participants[i] && FD_ISSET(participants[i]->parSD, &writeSet)) {
+				if (flushConnection(connections[participants[i]->parSD]) < 0) {
+					handleParticipantDisconnect(i);
+				}
+			}
+
 			// Participant exists
 			if (participants[i]) {
 				// Data ready to be read on observer SD
-				if (FD_ISSET(participants[i]->obsSD, &fdSet)) {
-					// check for disconnect
-					int trash[2];
-					if (recv(participants[i]->obsSD, trash, 2, 0) <= 0) {
-						handleObserverDisconnect(i);
-					}
+				if (participants[i]->obsSD >= 0 && FD_ISSET(participants[i]->obsSD, &fdSet)) {
+					handleObserverInput(i);
 				}
 
 				// Data ready to be read on participant SD
 				if (FD_ISSET(participants[i]->parSD, &fdSet)) {
-					if (participants[i]->active) {
-						// Active Participant
-						handleNewMessage(i);
-					} else {
-						// Inactive Participant
-						handleNewUsername(i);
-					}
+					handleParticipantInput(i);
 				}
 			}
 
+			if (unconObsSD[i] && FD_ISSET(unconObsSD[i], &writeSet) && flushConnection(connections[unconObsSD[i]]) < 0) {
+				closeConnection(unconObsSD[i]);
+				unconObsSD[i] = 0;
+			}
 			if (unconObsSD[i]) {
 				if (FD_ISSET(unconObsSD[i], &fdSet)) {
-					printf("Connecting Observer.\n");
+					logDebug("Connecting Observer.");
 					connectObserver(i);
 				}
 			}
+
+			// Refused, close once the answer is out
+			if (closingSD[i] && FD_ISSET(closingSD[i], &writeSet)) {
+				connStruct* conn = connections[closingSD[i]];
+
+				if (flushConnection(conn) < 0 || !conn->queued) {
+					closeConnection(closingSD[i]);
+					closingSD[i] = 0;
+				}
+			}
+		}
+
+		// Gateways, for everyone registered through them
+		for (int g = 0; g < MAX_GATEWAYS; g++) {
+			if (gateways[g] && FD_ISSET(gateways[g], &writeSet) && flushConnection(connections[gateways[g]]) < 0) {
+				handleGatewayDisconnect(g);
+			}
+			if (gateways[g] && FD_ISSET(gateways[g], &fdSet)) {
+				handleGatewayInput(g);
+			}
+		}
+
+		// Links to other nodes, and observers attached through them
+		for (int k = 0; k < numNodes; k++) {
+			nodeStruct* node = &nodes[k];
+			int err = 0;
+			socklen_t errSize = sizeof(err);
+
+			if (node->sd < 0) {
+				continue;
+			}
+
+			// Our connect finished, one way or the other
+			if (node->connecting) {
+				if (FD_ISSET(node->sd, &writeSet)) {
+					getsockopt(node->sd, SOL_SOCKET, SO_ERROR, &err, &errSize);
+					if (err) {
+						logDebug("Node %d: %s", node->id, strerror(err));
+						nodeDown(k);
+					} else {
+						nodeConnected(k);
+					}
+				}
+				continue;
+			}
+
+			if (FD_ISSET(node->sd, &writeSet) && flushConnection(connections[node->sd]) < 0) {
+				nodeDown(k);
+				continue;
+			}
+			if (FD_ISSET(node->sd, &fdSet)) {
+				handleNodeInput(k);
+			}
+		}
+
+		for (int p = 0; p < MAX_NODES; p++) {
+			if (pendingNodeSD[p] && FD_ISSET(pendingNodeSD[p], &fdSet)) {
+				handlePendingNode(p);
+			}
+		}
+
+		for (int r = 0; r < MAX_CLIENTS; r++) {
+			int obsSD = remoteObservers[r].sd;
+
+			if (obsSD && FD_ISSET(obsSD, &writeSet) && flushConnection(connections[obsSD]) < 0) {
+				handleRemoteObserverDisconnect(r, 1);
+				continue;
+			}
+			if (obsSD && FD_ISSET(obsSD, &fdSet) && !readObserver(connections[obsSD])) {
+				handleRemoteObserverDisconnect(r, 1);
+			}
+		}
+
+		if (nodeListenSD >= 0 && FD_ISSET(nodeListenSD, &fdSet)) {
+			acceptNode(nodeListenSD);
 		}
 
 		// Check for new participants
 		if (FD_ISSET(sd, &fdSet)) {
-			printf("%d\n", sd);
-			alen = sizeof(parPort);
-			int newFD = accept(sd, (struct sockaddr *)&pad, &alen);
-			handleNewParticipant(newFD);
+			logDebug("New Participant on %d", sd);
+			acceptConnections(sd, 0);
 		}
 
 		// Check for new observers
 		if (FD_ISSET(sd2, &fdSet)) {
-			printf("%d\n", sd2);
-			alen = sizeof(obsPort);
-			int newFD = accept(sd2, (struct sockaddr *)&oad, &alen);
-			printf("New Observer\n");
-			handleNewObserver(newFD);
+			logDebug("New Observer on %d", sd2);
+			acceptConnections(sd2, 1);
+		}
+
+		// Feed receivers asking for repairs
+		if (feedSD >= 0 && FD_ISSET(feedSD, &fdSet)) {
+			handleFeedRepair();
+		}
+
+		// Same again for local clients
+		if (unixParListenSD >= 0 && FD_ISSET(unixParListenSD, &fdSet)) {
+			acceptConnections(unixParListenSD, 0);
+		}
+		if (unixObsListenSD >= 0 && FD_ISSET(unixObsListenSD, &fdSet)) {
+			acceptConnections(unixObsListenSD, 1);
+		}
+
+		// Statistics requests
+		if (adminSD >= 0) {
+			for (int i = 0; i < MAX_ADMINS; i++) {
+				if (admins[i].sd && admins[i].response && FD_ISSET(admins[i].sd, &writeSet)) {
+					flushAdmin(i);
+				} else if (admins[i].sd && FD_ISSET(admins[i].sd, &fdSet)) {
+					handleAdminRequest(i);
+				}
+			}
+
+			if (FD_ISSET(adminSD, &fdSet)) {
+				int newFD = accept4(adminSD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+				if (newFD < 0 && (errno == EMFILE || errno == ENFILE)) {
+					shedConnection(adminSD);
+				}
+				handleNewAdmin(newFD);
+			}
 		}
+
+		uint64_t loopTime = nowNs() - loopStart;
+		histRecord(&loopHist, loopTime);
+		counters.loopIterations++;
+		counters.loopLastNs = loopTime;
+		if (loopTime > counters.loopMaxNs) {
+			counters.loopMaxNs = loopTime;
+		}
+
+		publishStats();
   }
 }
 
 // -1 = error, 0 = max clients, 1 = success
 int handleNewParticipant(int sd) {
 
-	// Check if at capacity
-	if (numParticipants == MAX_CLIENTS) {
-		if (send(sd, &n, 1, 0) <= 0) {
-			close(sd);
-			return -1;
-		}
-
-		close(sd);
+	// Check if at capacity, a replica has no room at all
+	if (numParticipants == MAX_CLIENTS || primaryNode >= 0) {
+		counters.connectionsRejected++;
+		traceRecord(TRACE_ACCEPT_PARTICIPANT, sd, 0, 0);
+		rejectConnection(connections[sd], n);
 		return 0;
 	}
 
+	traceRecord(TRACE_ACCEPT_PARTICIPANT, sd, 1, 0);
+
 	// Send confirmation
-	if (send(sd, &y, 1, 0) <= 0) {
-		close(sd);
+	if (sendReply(connections[sd], &y, 1) < 0) {
+		closeConnection(sd);
 		return -1;
 	}
 
@@ -277,6 +1162,21 @@ int handleNewParticipant(int sd) {
 	newParticipant->parSD = sd;
 	newParticipant->active = 0;
 	newParticipant->obsSD = -1;
+	newParticipant->duplex = 0;
+	newParticipant->obsNode = -1;
+	newParticipant->username[0] = '\0';
+
+	// Start with full buckets
+	newParticipant->messageBucket.tokens = messageRate * NS_PER_SEC;
+	newParticipant->messageBucket.refilledAt = nowNs();
+	newParticipant->byteBucket.tokens = ((byteRate < MAX_MESSAGE) ? MAX_MESSAGE : byteRate) * NS_PER_SEC;
+	newParticipant->byteBucket.refilledAt = newParticipant->messageBucket.refilledAt;
+	newParticipant->heldUntil = 0;
+	newParticipant->lastNotice = 0;
+	timerSet(&newParticipant->holdTimer, releaseHeldMessage, newParticipant);
+
+	// Username deadline
+	armTimeout(connections[sd], handshakeTimeout);
 
 	// Add Participant
 	addParticpant(newParticipant);
@@ -285,84 +1185,118 @@ int handleNewParticipant(int sd) {
 
 // -1 = error, 0 = failed (max capacity, invalid name, observer exists), 1 = success
 int handleNewObserver(int sd) {
-	participantStruct* participant;
+	int slot = -1;
 
-	// Check Capacity
-	if (numParticipants == MAX_CLIENTS) {
-		// Send Rejection
-		if (send(sd, &n, 1, 0) <= 0) {
-			close(sd);
-			return -1;
+	// Check Capacity, every pending observer needs a slot
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (!unconObsSD[i]) {
+			slot = i;
+			break;
 		}
+	}
 
-		// Close Socket
-		close(sd);
+	if (slot < 0) {
+		counters.connectionsRejected++;
+		traceRecord(TRACE_ACCEPT_OBSERVER, sd, 0, 0);
+		// Send Rejection, then close
+		rejectConnection(connections[sd], n);
 		return 0;
 	}
 
+	traceRecord(TRACE_ACCEPT_OBSERVER, sd, 1, 0);
+
 	// Send Confirmation
-	if (send(sd, &y, 1, 0) <= 0) {
-		close(sd);
+	if (sendReply(connections[sd], &y, 1) < 0) {
+		closeConnection(sd);
 		return -1;
 	}
 
 	// Re-evaluate Max Socket descriptor
 	maxSD = (sd < maxSD) ? maxSD : sd;
 
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (!unconObsSD[i]) {
-			printf("Index: %d\n", i);
-			memcpy(&(unconObsSD[i]), &sd, sizeof(int));
-			//unconObsSD[i] = sd;
-			return 1;
-		}
-	}
+	logDebug("Index: %d", slot);
+	unconObsSD[slot] = sd;
+
+	// Username deadline
+	armTimeout(connections[sd], handshakeTimeout);
+	return 1;
 }
 
 int connectObserver(int i) {
-	uint8_t usernameSize;
-	char username[11];
 	participantStruct* participant;
-
 	int sd = unconObsSD[i];
+	connStruct* conn = connections[sd];
 
 	// Get Username
-	recv(sd, &usernameSize, sizeof(uint8_t), 0);
-	recv(sd, username, usernameSize, 0);
+	int result = readFrame(conn, 1);
+	if (result < 0) {
+		closeConnection(sd);
+		unconObsSD[i] = 0;
+		return -1;
+	}
+	if (result == 0) {
+		return 0;
+	}
 
+	// Capabilities come before the name
+	result = handleHello(conn, 0);
+	if (result) {
+		if (result < 0) {
+			closeConnection(sd);
+			unconObsSD[i] = 0;
+		}
+		return result;
+	}
 
-	username[usernameSize] = '\0';
+	// Get participant with given name, names are at most 10 characters
+	int index = (conn->frameSize <= 10) ? getParticipantByName(conn->frame) : -1;
+	int home = (index < 0 && conn->frameSize <= 10) ? directoryLookup(conn->frame) : -1;
 
-	// Get participant with given name
-	int index = getParticipantByName(username);
+	// Lives on another node, which answers for it
+	if (home >= 0 && sendNode(home, NODE_ATTACH, LANE_CONTROL, conn->frame, sd, NULL, 0) == 0) {
+		conn->attachNode = home + 1;
+		returnFrame(conn);
+		return 0;
+	}
 
-	// No participant with name found
-	if (index < 0) {
-		// Send Rejection
-		if (send(sd, &n, 1, 0) <= 0) {
-			close(sd);
-			return -1;
-		}
+	// No participant with name found. Gateways see their users' messages already.
+	if (index < 0 && (conn->frameSize > 10 || getVirtualByName(conn->frame) < 0)) {
+		traceRecord(TRACE_OBSERVER_ATTACH, sd, 0, 0);
+		// Send Rejection, the observer gives up after this
+		unconObsSD[i] = 0;
+		rejectConnection(conn, n);
 		return 0;
 	}
 
-	participant = participants[index];
+	participant = (index >= 0) ? participants[index] : NULL;
+
+	// Observers hardly ever send again, don't keep a buffer for them
+	returnFrame(conn);
+
+	// Participant with name found, and not observing on its own connection
+	if (participant && participant->obsSD < 0 && participant->obsNode < 0 && !participant->duplex) {
+		traceRecord(TRACE_OBSERVER_ATTACH, sd, 1, 0);
+		unconObsSD[i] = 0;
+		armTimeout(conn, 0);
 
-	// Participant with name found
-	if (participant->obsSD < 0) {
 		// Send Confirmation
-		if (send(sd, &y, 1, 0) <= 0) {
-			close(sd);
+		if (sendReply(conn, &y, 1) < 0) {
+			closeConnection(sd);
 			return -1;
 		}
 
 		// Update participant's info
 		participant->obsSD = sd;
+		startKeepalive(conn);
 
 		// Increment observers
 		numObservers++;
 
-		unconObsSD[i] = 0;
+		// Everything from here on goes through shared memory
+		if ((conn->caps & PROTO_CAP_RING) && startRing(conn) < 0) {
+			handleObserverDisconnect(index);
+			return -1;
+		}
 
 		// Send Observer Message
 		uint8_t size = 26;
@@ -370,32 +1304,43 @@ int connectObserver(int i) {
 
 		sprintf(message, "A new observer has joined");
 
-		handlePublicMessages(message, size);
+		handlePublicMessages(message, size, LANE_CONTROL);
 
 		return 1;
 	}
 
 	// Participant with name already has an observer
-	if (send(sd, &t, 1, 0) <= 0) {
-		close(sd);
+	traceRecord(TRACE_OBSERVER_ATTACH, sd, 2, 0);
+	if (sendReply(conn, &t, 1) < 0) {
+		closeConnection(sd);
+		unconObsSD[i] = 0;
 		return -1;
 	}
+
+	// Another prompt, another deadline
+	armTimeout(conn, handshakeTimeout);
 	return 0;
 }
 
 int handleParticipantDisconnect(int i) {
-	uint16_t messageSize = 24;
-	char message[messageSize];
-	sprintf(message, "User %s has left", participants[i]->username);
-	handlePublicMessages(message, messageSize);
+	traceRecord(TRACE_PARTICIPANT_LEFT, participants[i]->parSD, 0, 0);
+
+	// Only users who got past the username prompt were announced
+	if (participants[i]->active) {
+		broadcastNodes(TO_PEERS | TO_REPLICAS, NODE_LEAVE, LANE_CONTROL, participants[i]->username, NULL, 0);
+		announcePresence(participants[i]->username, 1, 0);
+	}
 
 	// Close Sockets
-	close(participants[i]->parSD);
+	timerCancel(&timers, &participants[i]->holdTimer);
+	closeConnection(participants[i]->parSD);
 
-	if (participants[i]->obsSD > 0) {
+	if (participants[i]->obsSD >= 0) {
 		handleObserverDisconnect(i);
 	}
 
+	logInfo("Participant %s disconnected", participants[i]->username);
+
 	// Free the memory
 	free(participants[i]);
 
@@ -404,271 +1349,3777 @@ int handleParticipantDisconnect(int i) {
 
 	// Decrement clients
 	numParticipants--;
+	counters.participantDisconnects++;
 
-	printf("participant disconnected\n");
 }
 
 int handleObserverDisconnect(int i) {
+	traceRecord(TRACE_OBSERVER_LEFT, participants[i]->obsSD, 0, 0);
 	printParticipants();
 	// Close Sockets
-	close(participants[i]->obsSD);
+	closeConnection(participants[i]->obsSD);
 
 	// Free observer
 	participants[i]->obsSD = -1;
 
 	// Decrement Observers
 	numObservers--;
-	printf("observer disconnected\n");
+	counters.observerDisconnects++;
+	logInfo("Observer of %s disconnected", participants[i]->username);
+}
+
+// Send message to all observers, here and on every other node
+int handlePublicMessages(char message[], uint16_t messageSize, int lane) {
+	broadcastNodes(TO_PEERS, NODE_PUBLIC, lane, NULL, message, messageSize);
+	return deliverPublic(message, messageSize, lane);
 }
 
-// Send message to all observers
-int handlePublicMessages(char message[], uint16_t messageSize) {
-	printf("Public message\n");
+// Send message to the observers on this node, and our replicas' observers
+int deliverPublic(char message[], uint16_t messageSize, int lane) {
+	logDebug("Public message");
+
+	broadcastNodes(TO_REPLICAS, NODE_PUBLIC, lane, NULL, message, messageSize);
+
+	// Framed once, queued everywhere
+	msgBlock* block = newBlock(message, messageSize, 0);
+	if (!block) {
+		return -1;
+	}
 
 	for (int i = 0; i < MAX_CLIENTS; i++) {
 		if (participants[i]) {
 			// Get participant's observer SD
 			int sd = participants[i]->obsSD;
 
-			// Check if user has an observer
-			if (sd >= 0) {
+			// Check if user has an observer, or observes on its own connection
+			if (sd >= 0 || participants[i]->duplex) {
 				// Send Message
-				sendMessage(i, message, messageSize);
+				queueObserver(i, block, lane);
 			}
 		}
 	}
+
+	for (int r = 0; r < MAX_CLIENTS; r++) {
+		if (remoteObservers[r].sd) {
+			queueRemoteObserver(r, block, lane);
+		}
+	}
+
+	// Once per gateway, for all of its users
+	msgBlock* tagged = NULL;
+	for (int g = 0; g < MAX_GATEWAYS; g++) {
+		if (gateways[g] && (tagged || (tagged = newTaggedBlock(PROTO_GATEWAY_ALL, message, messageSize, 0)))) {
+			queueGateway(gateways[g], tagged, lane);
+		}
+	}
+	if (tagged) {
+		releaseBlock(tagged);
+	}
+
+	// And once for everyone listening to the group
+	if (feedSD >= 0) {
+		feedPublish(block);
+	}
+
+	releaseBlock(block);
+	return 1;
 }
 
 int handlePrivateMessages(char* message, uint16_t messageSize, int sender) {
 	char username[11];
+	int routed = routePrivate(message, messageSize, username);
 
+	if (routed == 0) {
+		return 0;
+	}
+	if (routed < 0) {
+		sprintf(message, "Warning: user %s doesn't exist...", username);
+		messageSize = strlen(message);
+		return sendMessage(sender, message, messageSize, LANE_CONTROL);
+	}
+
+	return sendMessage(sender, message, messageSize, LANE_BULK);
+}
+
+// Delivers a private message to whoever it names, wherever they are. The
+// name is left in username for the sender's warning.
+// -1 = no such user, 0 = error, 1 = success
+int routePrivate(char* message, uint16_t messageSize, char* username) {
+	// Name follows the '@', up to the first space
 	int i;
-	for (i = 0; message[15 + i] != ' '; i++) {
+	for (i = 0; i < 10 && 15 + i < messageSize && message[15 + i] != ' '; i++) {
 		username[i] = message[15 + i];
 	}
 	username[i] = 0;
 
 	int index = getParticipantByName(username);
+	int v = (index < 0) ? getVirtualByName(username) : -1;
+	int home = (index < 0 && v < 0) ? directoryLookup(username) : -1;
 	if (index >= 0) {
-		if (sendMessage(index, message, messageSize) < 0) {
+		if (sendMessage(index, message, messageSize, LANE_BULK) < 0) {
+			return 0;
+		}
+	} else if (v >= 0) {
+		if (sendVirtual(v, message, messageSize, LANE_BULK) < 0) {
+			return 0;
+		}
+	} else if (home >= 0) {
+		// Their node delivers it
+		if (sendNode(home, NODE_PRIVATE, LANE_BULK, username, 0, message, messageSize) < 0) {
 			return 0;
 		}
 	} else {
-		sprintf(message, "Warning: user %s doesn't exist...", username);
-		messageSize = 41;
+		return -1;
 	}
 
-	return sendMessage(sender, message, messageSize);
+	return 1;
 }
 
-// -1 = error, 0 = client disconnected, 1 = success
-int handleNewMessage(int i) {
-	char message[1000];
-	char newMessage[1014];
-	uint16_t messageSize;
-
-	// Get Message size
-	if (recv(participants[i]->parSD, &messageSize, sizeof(uint16_t), 0) <= 0) {
-		handleParticipantDisconnect(i);
-		return 0;
+// Tells every observer that username joined or left. With -c the news
+// waits for the window to close and goes out as one message per kind.
+// Local announcements are ones every node makes for itself.
+void announcePresence(const char* username, int left, int local) {
+	presenceDigest* digest = &presence[left][local];
+	int length = strlen(username);
+
+	// Everything announced here is a roster change too, remote users'
+	// comings and goings are announced by their node
+	rosterChange(username, left);
+
+	if (coalesceWindow <= 0) {
+		char message[32];
+		int size = sprintf(message, left ? "User %s has left" : "User %s has joined", username);
+
+		if (local) {
+			deliverPublic(message, size, LANE_CONTROL);
+		} else {
+			handlePublicMessages(message, size, LANE_CONTROL);
+		}
+		return;
 	}
 
-	if (messageSize > 1000) {
-		// Message too large
-		printf("messageSize: %d\n", messageSize);
-		handleParticipantDisconnect(i);
-		return 0;
+	if (!timerPending(&presenceTimer)) {
+		timerSchedule(&timers, &presenceTimer, nowNs() + coalesceWindow * 1000000ull);
 	}
 
-	// Get Message
-	if (recv(participants[i]->parSD, message, messageSize, 0) <= 0) {
-		handleParticipantDisconnect(i);
-		return 0;
+	digest->count++;
+	if (digest->size + length + 2 <= DIGEST_NAMES) {
+		digest->size += sprintf(digest->names + digest->size, "%s%s", digest->listed ? ", " : "", username);
+		digest->listed++;
 	}
+}
 
+// The window is over, or the process is about to hand over
+void flushPresence(void* arg) {
+	char message[DIGEST_NAMES + 64];
+	int size;
 
-	//printf("before: %s\n", message);
-	sprintf(newMessage, ">%11s: %s", participants[i]->username, message);
+	(void)arg;
+
+	timerCancel(&timers, &presenceTimer);
+
+	// Leaves first, so whoever reconnected within the window is still here
+	for (int left = 1; left >= 0; left--) {
+		for (int local = 0; local < 2; local++) {
+			presenceDigest* digest = &presence[left][local];
+
+			if (digest->count == 0) {
+				continue;
+			}
+
+			if (digest->count == 1) {
+				size = sprintf(message, left ? "User %s has left" : "User %s has joined", digest->names);
+			} else {
+				size = sprintf(message, "%d users %s: %s", digest->count, left ? "left" : "joined", digest->names);
+				if (digest->listed < digest->count) {
+					size += sprintf(message + size, " and %d more", digest->count - digest->listed);
+				}
+			}
+			digest->count = digest->listed = digest->size = 0;
+
+			if (local) {
+				deliverPublic(message, size, LANE_CONTROL);
+			} else {
+				handlePublicMessages(message, size, LANE_CONTROL);
+			}
+		}
+	}
+}
+
+// Numbers the change, keeps it for clients that catch up later and
+// sends it to those following along
+void rosterChange(const char* username, int left) {
+	rosterStep* step = &rosterHistory[++rosterVersion & (ROSTER_HISTORY - 1)];
+	char frame[ROSTER_FRAME];
+	int size = PROTO_ROSTER_HEADER;
+	uint8_t flags = 0;
+
+	step->version = rosterVersion;
+	step->op = left ? PROTO_ROSTER_REMOVE : PROTO_ROSTER_ADD;
+	strcpy(step->username, username);
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && connections[participants[i]->parSD]->roster) {
+			connStruct* conn = connections[participants[i]->parSD];
+
+			size = PROTO_ROSTER_HEADER;
+			if (rosterAppend(conn, frame, &size, &flags, step->op, username) == 0) {
+				rosterSend(conn, frame, size, flags);
+			}
+		}
+		if (i < MAX_GATEWAYS && gateways[i] && connections[gateways[i]]->roster) {
+			size = PROTO_ROSTER_HEADER;
+			if (rosterAppend(connections[gateways[i]], frame, &size, &flags, step->op, username) == 0) {
+				rosterSend(connections[gateways[i]], frame, size, flags);
+			}
+		}
+	}
+}
+
+// A client asked for the roster, telling us the version it has. It gets
+// the changes since then if we still have them all, or the whole roster,
+// and every change from now on.
+void rosterRequest(connStruct* conn) {
+	char frame[ROSTER_FRAME];
+	int size = PROTO_ROSTER_HEADER;
+	uint8_t flags = 0;
+	uint64_t known;
+
+	memcpy(&known, conn->frame + 1, sizeof(uint64_t));
+	conn->roster = 1;
+
+	// The history holds the last ROSTER_HISTORY changes, if it goes back far enough
+	if (known <= rosterVersion && rosterVersion - known < ROSTER_HISTORY
+			&& (known == rosterVersion || rosterHistory[(known + 1) & (ROSTER_HISTORY - 1)].version == known + 1)) {
+		counters.rosterDeltas++;
+		for (uint64_t v = known + 1; v <= rosterVersion; v++) {
+			rosterStep* step = &rosterHistory[v & (ROSTER_HISTORY - 1)];
+
+			if (rosterAppend(conn, frame, &size, &flags, step->op, step->username) < 0) {
+				return;
+			}
+		}
+		rosterSend(conn, frame, size, flags);
+		return;
+	}
+
+	counters.rosterFull++;
+	flags = PROTO_ROSTER_RESET;
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && participants[i]->active
+				&& rosterAppend(conn, frame, &size, &flags, PROTO_ROSTER_ADD, participants[i]->username) < 0) {
+			return;
+		}
+	}
+	for (int v = 0; v < MAX_VIRTUAL && numVirtual; v++) {
+		if (virtualUsers[v].username[0]
+				&& rosterAppend(conn, frame, &size, &flags, PROTO_ROSTER_ADD, virtualUsers[v].username) < 0) {
+			return;
+		}
+	}
+	for (int d = 0; d < MAX_DIRECTORY; d++) {
+		if (directory[d].username[0]
+				&& rosterAppend(conn, frame, &size, &flags, PROTO_ROSTER_ADD, directory[d].username) < 0) {
+			return;
+		}
+	}
+	rosterSend(conn, frame, size, flags);
+}
+
+// Adds one entry to the frame being built, sending it first with
+// PROTO_ROSTER_MORE if it is full
+// -1 = client going away, 0 = success
+int rosterAppend(connStruct* conn, char* frame, int* size, uint8_t* flags, char op, const char* username) {
+	int length = strlen(username);
+
+	if (*size + 2 + length > ROSTER_FRAME) {
+		if (rosterSend(conn, frame, *size, *flags | PROTO_ROSTER_MORE) < 0) {
+			return -1;
+		}
+		*flags &= ~PROTO_ROSTER_RESET;
+		*size = PROTO_ROSTER_HEADER;
+	}
+
+	frame[(*size)++] = op;
+	frame[(*size)++] = length;
+	memcpy(frame + *size, username, length);
+	*size += length;
+	return 0;
+}
+
+// Same as a duplex participant, a client too far behind is shut down
+// and the main loop cleans up after it
+// -1 = client going away, 0 = success
+int rosterSend(connStruct* conn, char* frame, int size, uint8_t flags) {
+	msgBlock* block;
+
+	frame[0] = PROTO_ROSTER_UPDATE;
+	frame[1] = flags;
+	memcpy(frame + 2, &rosterVersion, sizeof(uint64_t));
+
+	block = newBlock(frame, size, 1);
+	if (!block || queueFrame(conn, block, LANE_CONTROL) < 0) {
+		if (block) {
+			releaseBlock(block);
+		}
+		discardQueue(conn);
+		shutdown(conn->sd, SHUT_RDWR);
+		return -1;
+	}
+	releaseBlock(block);
+	return 0;
+}
+
+// Handles the frame readFrame just completed
+// -1 = error, 0 = nothing sent, 1 = success
+int handleNewMessage(int i) {
+	participantStruct* participant = participants[i];
+	connStruct* conn = connections[participant->parSD];
+	char* message = conn->frame;
+	char newMessage[MAX_MESSAGE + 14];
+	uint16_t messageSize = conn->frameSize;
+	uint64_t now = nowNs();
+	uint64_t wait;
+
+	// Empty line, nothing to say
+	if (!messageSize) {
+		return 0;
+	}
+
+	// Over the limit, park it or drop it
+	wait = takeTokens(participant, messageSize, now);
+	if (wait) {
+		if (!rejectOverLimit) {
+			// The frame stays in conn->frame, nothing more is read until it goes out
+			if (!participant->heldUntil) {
+				participant->heldSince = now;
+				counters.messagesDelayed++;
+			}
+			participant->heldUntil = now + wait;
+			timerSchedule(&timers, &participant->holdTimer, participant->heldUntil);
+
+			// Pongs queue up unread behind it, so the deadlines wait too
+			timerCancel(&timers, &conn->keepaliveTimer);
+			armTimeout(conn, 0);
+			return 0;
+		}
+
+		counters.messagesRejected++;
+
+		// One notice a second is plenty
+		if ((participant->obsSD >= 0 || participant->obsNode >= 0 || participant->duplex) && now - participant->lastNotice >= NS_PER_SEC) {
+			char notice[] = "Warning: rate limit exceeded, message dropped";
+
+			participant->lastNotice = now;
+			sendMessage(i, notice, strlen(notice), LANE_CONTROL);
+		}
+		return 0;
+	}
+
+	// Last byte is in, start the ingress-to-egress clock. A delayed message
+	// counts from when it arrived, the wait is time spent in the server.
+	messageReceivedAt = participant->heldUntil ? participant->heldSince : now;
+	if (participant->heldUntil) {
+		// Reading again, the deadlines start over
+		participant->heldUntil = 0;
+		conn->pingsOutstanding = 0;
+		armTimeout(conn, idleTimeout);
+		startKeepalive(conn);
+	}
+	counters.messagesIn++;
+	counters.bytesIn += messageSize;
+	traceRecord(TRACE_MESSAGE_IN, participants[i]->parSD, messageSize, message[0] == '@');
+	int result;
+
+
+	sprintf(newMessage, ">%11s: ", participants[i]->username);
+	memcpy(newMessage + 14, message, messageSize);
 	messageSize += 14;
-	//newMessage[messageSize] = 0;
-	//printf("after: %s\n", newMessage);
 
 	// Check if private message
 	if (message[0] == '@') {
 		newMessage[0] = '-';
-		return handlePrivateMessages(newMessage, messageSize, i);
+		result = handlePrivateMessages(newMessage, messageSize, i);
+	} else {
+		// Public message, the only kind moderators can search
+		if (searchWindow > 0) {
+			searchAdd(&search, newMessage, messageSize);
+		}
+		result = handlePublicMessages(newMessage, messageSize, LANE_BULK);
 	}
 
-	// Public message
-	return handlePublicMessages(newMessage, messageSize);
+	messageReceivedAt = 0;
+	return result;
 }
 
+// Handles the username frame readFrame just completed
 int handleNewUsername(int i) {
-	char username[11];
-	uint8_t usernameSize;
-	int valid;
 	participantStruct* participant = participants[i];
+	connStruct* conn = connections[participant->parSD];
+	char* username = conn->frame;
+	int valid;
 
-	// Get Username
-	if (receiveUsername(i, username, &usernameSize, 1) < 0) {
-		return -1;
+	// Capabilities come before the name
+	valid = handleHello(conn, 1);
+	if (valid) {
+		if (valid < 0) {
+			handleParticipantDisconnect(i);
+		}
+		return valid;
 	}
 
-	username[usernameSize] = '\0';
+	// A gateway's token instead
+	if (conn->caps & PROTO_CAP_GATEWAY) {
+		return startGateway(i);
+	}
 
 	// Check if name is valid and available
 	valid = checkUsername(username);
+	traceRecord(TRACE_USERNAME, participant->parSD, valid, 0);
 
 	if (valid > 0) {
 		// Send Confirmation
-		if (send(participant->parSD, &y, 1 ,0) <= 0) {
-			close(participant->parSD);
+		if (sendReply(conn, &y, 1) < 0) {
+			handleParticipantDisconnect(i);
 			return -1;
 		}
 
 		// Update Participant
-		strncpy(participant->username, username, usernameSize+1);
+		strcpy(participant->username, username);
 		participant->active = 1;
+		participant->duplex = (conn->caps & PROTO_CAP_DUPLEX) != 0;
+		armTimeout(conn, idleTimeout);
+		startKeepalive(conn);
 
+		// The name is ours everywhere now
+		broadcastNodes(TO_PEERS | TO_REPLICAS, NODE_JOIN, LANE_CONTROL, participant->username, NULL, 0);
 
-		uint16_t size = strlen(participant->username) + 16;
-
-		char message[size];
-		sprintf(message, "User %s has joined", participant->username);
-		printf("%s\n", message);
+		logInfo("User %s has joined", participant->username);
 
 		// Send connection message
-		handlePublicMessages(message, size);
+		announcePresence(participant->username, 0, 0);
 
 	} else if (valid < 0) {
 		// Invalid Name
-		if (send(participant->parSD, &n, 1, 0) <= 0) {
-			close(participant->parSD);
+		if (sendReply(conn, &n, 1) < 0) {
+			handleParticipantDisconnect(i);
+			return -1;
 		}
+		armTimeout(conn, handshakeTimeout);
 	} else {
 		// Username Taken
-		if (send(participant->parSD, &t, 1, 0) <= 0) {
-			close(participant->parSD);
+		if (sendReply(conn, &t, 1) < 0) {
+			handleParticipantDisconnect(i);
+			return -1;
 		}
+		armTimeout(conn, handshakeTimeout);
 	}
+
+	return valid;
 }
 
-int sendMessage(int parID, char* message, uint16_t messageSize) {
-	if (send(participants[parID]->obsSD, &messageSize, sizeof(uint16_t), 0) < 0) {
-		handleObserverDisconnect(parID);
+// Queues a message for one participant's observer, if it has one
+// -1 = error, 0 = success
+int sendMessage(int parID, char* message, uint16_t messageSize, int lane) {
+	msgBlock* block;
+	int result;
+
+	// Observer attached through another node
+	if (participants[parID]->obsSD < 0 && participants[parID]->obsNode >= 0) {
+		return sendNode(participants[parID]->obsNode, NODE_DELIVER, lane, participants[parID]->username, 0, message, messageSize);
+	}
+
+	if (participants[parID]->obsSD < 0 && !participants[parID]->duplex) {
+		return 0;
+	}
+
+	block = newBlock(message, messageSize, 0);
+	if (!block) {
+		counters.drops++;
 		return -1;
 	}
-	if (send(participants[parID]->obsSD, message, messageSize, 0) < 0) {
-		handleObserverDisconnect(parID);
+
+	result = queueObserver(parID, block, lane);
+	releaseBlock(block);
+	return result;
+}
+
+// Queues a handshake answer ('Y', 'N', 'T' or a hello reply) ahead of
+// everything else, so a peer that doesn't read never stalls the loop
+// -1 = error, 0 = success
+int sendReply(connStruct* conn, const void* reply, int size) {
+	msgBlock* block = malloc(sizeof(msgBlock) + size);
+	int result;
+
+	if (!block) {
 		return -1;
 	}
 
-	return 0;
+	// Raw bytes, handshake answers have no size prefix
+	block->refs = 1;
+	block->size = size;
+	block->receivedAt = 0;
+	memcpy(block->data, reply, size);
+
+	result = queueFrame(conn, block, LANE_CONTROL);
+	releaseBlock(block);
+	return result;
 }
 
-int receiveUsername(int index, char message[], uint8_t* size, int exists) {
-	if (recv(participants[index]->parSD, size, sizeof(uint8_t), 0) <= 0) {
-		if (exists) {
-			handleParticipantDisconnect(index);
-			return -1;
-		}
+// Sends a last answer and closes the connection once it is out, or after
+// SEND_TIMEOUT_MS if the peer never takes it
+void rejectConnection(connStruct* conn, char reply) {
+	int sd = conn->sd;
+	int c;
+
+	for (c = 0; c < MAX_CLIENTS && closingSD[c]; c++) {
+	}
+
+	if (sendReply(conn, &reply, 1) < 0 || !conn->queued || c == MAX_CLIENTS) {
+		closeConnection(sd);
+		return;
+	}
+
+	// Nothing more is read from it
+	closingSD[c] = sd;
+	returnFrame(conn);
+	timerCancel(&timers, &conn->keepaliveTimer);
+	timerSchedule(&timers, &conn->timer, nowNs() + SEND_TIMEOUT_MS * 1000000ull);
+}
+
+// Frames a message into a block holding one reference. Messages read from
+// a participant carry their ingress time along.
+msgBlock* newBlock(const char* message, uint16_t messageSize, int control) {
+	msgBlock* block = malloc(sizeof(msgBlock) + sizeof(uint16_t) + messageSize);
+	uint16_t header = control ? (PROTO_CONTROL | messageSize) : messageSize;
+
+	if (!block) {
+		return NULL;
+	}
+
+	block->refs = 1;
+	block->size = sizeof(uint16_t) + messageSize;
+	block->receivedAt = messageReceivedAt;
+	memcpy(block->data, &header, sizeof(uint16_t));
+	memcpy(block->data + sizeof(uint16_t), message, messageSize);
+	return block;
+}
+
+void releaseBlock(msgBlock* block) {
+	if (--block->refs == 0) {
+		free(block);
 	}
+}
 
-	if (recv(participants[index]->parSD, message, *size, 0) <= 0) {
-		if (exists) {
-			handleParticipantDisconnect(index);
+// Observer side of queueFrame, a peer that can't keep up is disconnected
+// -1 = observer dropped, 0 = success
+int queueObserver(int parID, msgBlock* block, int lane) {
+	// Dropping a participant here would announce it from inside a delivery,
+	// so just shut the socket and let the main loop find it closed
+	if (participants[parID]->duplex) {
+		connStruct* conn = connections[participants[parID]->parSD];
+
+		if (queueFrame(conn, block, lane) < 0) {
+			discardQueue(conn);
+			shutdown(conn->sd, SHUT_RDWR);
 			return -1;
 		}
+		return 0;
 	}
 
+	if (queueFrame(connections[participants[parID]->obsSD], block, lane) < 0) {
+		handleObserverDisconnect(parID);
+		return -1;
+	}
 	return 0;
 }
 
-// valid = 1, invalid = -1, taken = 0
-int checkUsername(char username[]) {
-	int result;
-	char c;
-	int size = strlen(username);
-	int participantsChecked = 0;
+// Appends a frame to one of the connection's lanes and writes whatever the
+// socket will take right away.
+// -1 = error or peer too far behind, 0 = success
+int queueFrame(connStruct* conn, msgBlock* block, int lane) {
+	outEntry* entry;
+	outLane* queue = &conn->lanes[lane];
 
-	// Check Validity
-	for (int i = 0; i < size; i++) {
-		c = username[i];
-		if (!isalnum(c) && !(c == '_')) {
-			return -1;
-		}
+	// Same-host observer, straight into its ring
+	if (conn->ring) {
+		return ringDeliver(conn, block);
 	}
 
-	// Check Availability
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (participants[i] && participants[i]->active) {
-			if (!strcmp(participants[i]->username, username)) {
-				return 0;
+	if (conn->queued + block->size > OUT_QUEUE_MAX) {
+		logWarn("Peer on %d is %d bytes behind, dropping it", conn->sd, conn->queued);
+		counters.drops++;
+		return -1;
+	}
+
+	entry = malloc(sizeof(outEntry));
+	if (!entry) {
+		counters.drops++;
+		return -1;
+	}
+	entry->next = NULL;
+	entry->block = block;
+	block->refs++;
+
+	if (queue->tail) {
+		queue->tail->next = entry;
+	} else {
+		queue->head = entry;
+	}
+	queue->tail = entry;
+	conn->queued += block->size;
+
+	// Something was already waiting, so the socket is full. select tells us when it isn't.
+	if (conn->queued > block->size) {
+		return 0;
+	}
+	return flushConnection(conn);
+}
+
+// Writes queued frames until the socket is full or the lanes are empty,
+// up to WRITE_BATCH frames per writev.
+// -1 = error, 0 = success
+int flushConnection(connStruct* conn) {
+	struct iovec iov[WRITE_BATCH];
+
+	while (conn->queued) {
+		outEntry* control = conn->lanes[LANE_CONTROL].head;
+		outEntry* bulk = conn->lanes[LANE_BULK].head;
+		int burst = conn->burst;
+		int count = 0;
+		ssize_t written;
+		uint64_t start, end;
+
+		// Finish the frame on the wire before anything else
+		if (conn->partial) {
+			iov[count].iov_base = conn->partial->block->data + conn->sent;
+			iov[count].iov_len = conn->partial->block->size - conn->sent;
+			count++;
+		}
+
+		// Then the order nextFrame will take them off the lanes in
+		while (count < WRITE_BATCH) {
+			outEntry* entry;
+			int lane = pickLane(control, bulk, burst);
+
+			if (lane < 0) {
+				break;
 			}
-			participantsChecked++;
+			if (lane == LANE_CONTROL) {
+				entry = control;
+				control = control->next;
+				burst++;
+			} else {
+				entry = bulk;
+				bulk = bulk->next;
+				burst = 0;
+			}
+			iov[count].iov_base = entry->block->data;
+			iov[count].iov_len = entry->block->size;
+			count++;
+		}
 
-			if (participantsChecked >= numParticipants) {
+		start = nowNs();
+		written = writev(conn->sd, iov, count);
+		end = nowNs();
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		histRecord(&sendHist, end - start);
+		traceRecord(TRACE_SEND, conn->sd, written, end - start);
+		conn->queued -= written;
+
+		// Retire what went out, the rest stays where it was
+		while (written > 0) {
+			if (!conn->partial) {
+				conn->partial = nextFrame(conn);
+				conn->sent = 0;
+			}
+
+			msgBlock* block = conn->partial->block;
+			int left = block->size - conn->sent;
+
+			if (written < left) {
+				conn->sent += written;
 				break;
 			}
+			written -= left;
+
+			counters.messagesOut++;
+			counters.bytesOut += block->size;
+			if (block->receivedAt) {
+				histRecord(&ingressHist, end - block->receivedAt);
+			}
+
+			releaseBlock(block);
+			free(conn->partial);
+			conn->partial = NULL;
 		}
 	}
 
-	// Name is valid and available
-	return 1;
+	return 0;
+}
+
+// Control goes first, but only LANE_BURST frames in a row while bulk is waiting
+// Returns the lane to take from, -1 if both are empty
+int pickLane(outEntry* control, outEntry* bulk, int burst) {
+	if (control && (!bulk || burst < LANE_BURST)) {
+		return LANE_CONTROL;
+	}
+	return bulk ? LANE_BULK : -1;
 }
 
+// Takes the next frame off its lane, in the order flushConnection wrote them
+outEntry* nextFrame(connStruct* conn) {
+	int lane = pickLane(conn->lanes[LANE_CONTROL].head, conn->lanes[LANE_BULK].head, conn->burst);
+	outLane* queue;
+	outEntry* entry;
 
-// Returns 0 if successfully added partipant
-int addParticpant(participantStruct* participant) {
-	numParticipants++;
-	maxSD = (participant->parSD < maxSD) ? maxSD : participant->parSD;
+	if (lane < 0) {
+		return NULL;
+	}
 
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (!participants[i]) {
-			participants[i] = participant;
-			return i;
-		}
+	queue = &conn->lanes[lane];
+	entry = queue->head;
+	queue->head = entry->next;
+	if (!queue->head) {
+		queue->tail = NULL;
 	}
 
-	return -1;
+	conn->burst = (lane == LANE_CONTROL) ? conn->burst + 1 : 0;
+	return entry;
 }
 
-int getParticipantByName(char username[]) {
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (participants[i] && !strcmp(participants[i]->username, username)) {
-			return i;
-		}
+// Frees everything still queued on a closing connection
+// Returns the number of frames that never went out
+int discardQueue(connStruct* conn) {
+	int discarded = 0;
+
+	if (conn->partial) {
+		releaseBlock(conn->partial->block);
+		free(conn->partial);
+		conn->partial = NULL;
+		discarded++;
 	}
-	return -1;
+
+	for (outEntry* entry = nextFrame(conn); entry; entry = nextFrame(conn)) {
+		releaseBlock(entry->block);
+		free(entry);
+		discarded++;
+	}
+
+	conn->queued = 0;
+	return discarded;
 }
 
-void resetFdSet(int sd, int sd2) {
-	FD_ZERO(&fdSet);
-	FD_SET(sd, &fdSet);
-	FD_SET(sd2, &fdSet);
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (participants[i]) {
-			FD_SET(participants[i]->parSD, &fdSet);
-			if (participants[i]->obsSD > 0) {
-				FD_SET(participants[i]->obsSD, &fdSet);
+// Collects one size-prefixed frame without blocking, across as many calls
+// as it takes. headerSize is 1 for usernames and 2 for messages.
+// -1 = closed, error or oversized, 0 = need more data, 1 = frame in conn->frame
+int readFrame(connStruct* conn, int headerSize) {
+	int size;
+
+	// The last frame has been dispatched, the next may be a while
+	if (conn->headerRead == 0) {
+		returnFrame(conn);
+	}
+
+	// Size prefix
+	while (conn->headerRead < headerSize) {
+		size = recv(conn->sd, conn->header + conn->headerRead, headerSize - conn->headerRead, 0);
+		if (size <= 0) {
+			return (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? 0 : -1;
+		}
+		conn->headerRead += size;
+
+		if (conn->headerRead == headerSize) {
+			if (headerSize == 1) {
+				conn->frameSize = conn->header[0];
+			} else {
+				memcpy(&conn->frameSize, conn->header, sizeof(uint16_t));
+			}
+
+			// Control frames carry a flag in the size
+			conn->control = (headerSize == 2 && (conn->frameSize & PROTO_CONTROL));
+			conn->frameSize &= ~PROTO_CONTROL;
+
+			if (conn->frameSize > conn->maxFrame) {
+				logWarn("Frame too large on %d: %d", conn->sd, conn->frameSize);
+				return -1;
 			}
+			conn->bytesRead = 0;
 		}
-		if (unconObsSD[i]) {
-			FD_SET(unconObsSD[i], &fdSet);
+	}
+
+	// Body, into a buffer only once there is one to fill
+	if (!conn->frame && !(conn->frame = borrowFrame())) {
+		logError("Out of receive buffers on %d", conn->sd);
+		return -1;
+	}
+	while (conn->bytesRead < conn->frameSize) {
+		size = recv(conn->sd, conn->frame + conn->bytesRead, conn->frameSize - conn->bytesRead, 0);
+		if (size <= 0) {
+			return (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? 0 : -1;
 		}
+		conn->bytesRead += size;
 	}
+
+	// Ready for the next frame
+	conn->frame[conn->frameSize] = '\0';
+	conn->headerRead = 0;
+	return 1;
 }
 
-void printParticipants () {
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-		if (participants[i]) {
-			printParticipant(participants[i]);
+// Most connections are idle most of the time, so receive buffers are
+// lent out per frame rather than owned
+char* borrowFrame() {
+	framesBorrowed++;
+	if (framePoolIdle > 0) {
+		return framePool[--framePoolIdle];
+	}
+
+	char* frame = malloc(MAX_FRAME + 1);
+	if (!frame) {
+		framesBorrowed--;
+	}
+	return frame;
+}
+
+void returnFrame(connStruct* conn) {
+	if (!conn->frame) {
+		return;
+	}
+
+	framesBorrowed--;
+	if (framePoolIdle < FRAME_POOL_IDLE) {
+		framePool[framePoolIdle++] = conn->frame;
+	} else {
+		free(conn->frame);
+	}
+	conn->frame = NULL;
+}
+
+// Reads whatever the participant has sent, at most FRAME_BUDGET frames so
+// one busy sender cannot starve everyone else.
+// 0 = participant gone, 1 = still connected
+int handleParticipantInput(int i) {
+	for (int frames = 0; frames < FRAME_BUDGET; frames++) {
+		participantStruct* participant = participants[i];
+		int result;
+
+		if (!participant) {
+			return 0;
+		}
+
+		result = readFrame(connections[participant->parSD], participant->active ? 2 : 1);
+		if (result < 0) {
+			handleParticipantDisconnect(i);
+			return 0;
+		}
+		if (result == 0) {
+			return 1;
+		}
+
+		if (participant->active && connections[participant->parSD]->control) {
+			// Pong or similar, not something to say
+			handleControlFrame(connections[participant->parSD]);
+		} else if (participant->active) {
+			// Active Participant, still alive
+			armTimeout(connections[participant->parSD], idleTimeout);
+			handleNewMessage(i);
+
+			// Held for the rate limit, stop reading
+			if (participant->heldUntil) {
+				return 1;
+			}
+		} else {
+			// Inactive Participant
+			handleNewUsername(i);
 		}
 	}
+
+	return participants[i] != NULL;
 }
 
-void printParticipant (participantStruct* participant) {
-	printf ("%s: \tpar:%d\tobs:%d\n", participant->username, participant->parSD, participant->obsSD);
+// Observers only send control frames, and only if they asked for pings.
+// Anything else is read and thrown away, what matters is noticing EOF.
+// 0 = observer gone, 1 = still connected
+int handleObserverInput(int i) {
+	if (!readObserver(connections[participants[i]->obsSD])) {
+		handleObserverDisconnect(i);
+		return 0;
+	}
+	return 1;
+}
+
+// The reading half of handleObserverInput, for local and remote observers
+// 0 = observer gone, 1 = still connected
+int readObserver(connStruct* conn) {
+	if (!(conn->caps & PROTO_CAP_PING)) {
+		char trash[64];
+		int size = recv(conn->sd, trash, sizeof(trash), 0);
+
+		if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			return 0;
+		}
+		return 1;
+	}
+
+	for (int frames = 0; frames < FRAME_BUDGET; frames++) {
+		int result = readFrame(conn, 2);
+
+		if (result < 0) {
+			return 0;
+		}
+		if (result == 0) {
+			break;
+		}
+		if (conn->control) {
+			handleControlFrame(conn);
+		}
+	}
+
+	return 1;
+}
+
+// Refills both buckets and takes one message of size bytes if they allow it.
+// Returns 0 if taken, otherwise nanoseconds until it would be allowed
+uint64_t takeTokens(participantStruct* participant, int size, uint64_t now) {
+	uint64_t messageCost = NS_PER_SEC;
+	uint64_t byteCost = (uint64_t)size * NS_PER_SEC;
+	uint64_t wait = 0;
+
+	// Burst of one second, and the byte bucket always fits one full message
+	if (messageRate) {
+		refillBucket(&participant->messageBucket, messageRate, messageRate * NS_PER_SEC, now);
+		if (participant->messageBucket.tokens < messageCost) {
+			wait = (messageCost - participant->messageBucket.tokens) / messageRate;
+		}
+	}
+
+	if (byteRate) {
+		uint64_t capacity = ((byteRate < MAX_MESSAGE) ? MAX_MESSAGE : byteRate) * NS_PER_SEC;
+		refillBucket(&participant->byteBucket, byteRate, capacity, now);
+		if (participant->byteBucket.tokens < byteCost) {
+			uint64_t byteWait = (byteCost - participant->byteBucket.tokens) / byteRate;
+			wait = (byteWait > wait) ? byteWait : wait;
+		}
+	}
+
+	if (wait) {
+		// Round up to a whole millisecond for select
+		return wait + 1000000;
+	}
+
+	if (messageRate) {
+		participant->messageBucket.tokens -= messageCost;
+	}
+	if (byteRate) {
+		participant->byteBucket.tokens -= byteCost;
+	}
+	return 0;
+}
+
+// tokens += elapsed * rate, capped. Elapsed is clamped first, the bucket is
+// full after one second anyway and this keeps the product from overflowing.
+uint64_t refillBucket(tokenBucket* bucket, uint64_t rate, uint64_t capacity, uint64_t now) {
+	uint64_t elapsed = now - bucket->refilledAt;
+
+	if (elapsed > 2 * NS_PER_SEC) {
+		elapsed = 2 * NS_PER_SEC;
+	}
+
+	bucket->tokens += elapsed * rate;
+	if (bucket->tokens > capacity) {
+		bucket->tokens = capacity;
+	}
+	bucket->refilledAt = now;
+	return bucket->tokens;
+}
+
+// Timer callback: the held message's tokens have come in. Delivers it, or
+// holds it again if another message used them, and resumes reading.
+void releaseHeldMessage(void* arg) {
+	participantStruct* participant = arg;
+	int i = getParticipantBySD(participant->parSD);
+
+	handleNewMessage(i);
+	if (participants[i] && !participant->heldUntil) {
+		handleParticipantInput(i);
+	}
+}
+
+// (Re)starts the connection's deadline, 0 seconds cancels it
+void armTimeout(connStruct* conn, int seconds) {
+	if (seconds > 0) {
+		timerSchedule(&timers, &conn->timer, nowNs() + seconds * NS_PER_SEC);
+	} else {
+		timerCancel(&timers, &conn->timer);
+	}
+}
+
+// Timer callback: no username in time, or a participant went quiet
+void connectionTimedOut(void* arg) {
+	connStruct* conn = arg;
+	int sd = conn->sd;
+	int i = getParticipantBySD(sd);
+
+	if (i >= 0) {
+		participantStruct* participant = participants[i];
+
+		traceRecord(TRACE_TIMEOUT, sd, participant->active, 0);
+		if (participant->active) {
+			counters.idleTimeouts++;
+			logInfo("Participant %s idle too long", participant->username);
+		} else {
+			counters.handshakeTimeouts++;
+			logInfo("Participant on %d sent no username", sd);
+		}
+		handleParticipantDisconnect(i);
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (unconObsSD[i] == sd) {
+			traceRecord(TRACE_TIMEOUT, sd, 0, 0);
+			counters.handshakeTimeouts++;
+			logInfo("Observer on %d sent no username", sd);
+			closeConnection(sd);
+			unconObsSD[i] = 0;
+			return;
+		}
+	}
+
+	for (i = 0; i < MAX_NODES; i++) {
+		if (pendingNodeSD[i] == sd) {
+			logInfo("Node on %d sent no hello", sd);
+			closeConnection(sd);
+			pendingNodeSD[i] = 0;
+			return;
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (closingSD[i] == sd) {
+			logDebug("Refused peer on %d never took its answer", sd);
+			closeConnection(sd);
+			closingSD[i] = 0;
+			return;
+		}
+	}
+}
+
+// Answers a hello if that is what the username frame is
+// -1 = error, 0 = not a hello, 1 = hello answered
+int handleHello(connStruct* conn, int participant) {
+	uint8_t reply[2] = { PROTO_HELLO, 0 };
+
+	if (conn->frameSize != 2 || conn->frame[0] != PROTO_HELLO) {
+		return 0;
+	}
+
+	// Pings are all we have, and only worth it if we send them
+	if (keepaliveInterval > 0) {
+		reply[1] = conn->frame[1] & PROTO_CAP_PING;
+	}
+
+	// Rings only for clients that are surely on this host. A ring reader
+	// sleeps on its eventfd, not the socket, so it can't answer pings.
+	struct sockaddr_storage local;
+	socklen_t localSize = sizeof(local);
+
+	if (ringSize && (conn->frame[1] & PROTO_CAP_RING) && getsockname(conn->sd, (struct sockaddr*) &local, &localSize) == 0
+			&& local.ss_family == AF_UNIX) {
+		reply[1] = PROTO_CAP_RING;
+	}
+
+	// A participant may take its observer's messages itself, or speak for
+	// many, and may follow the roster
+	if (participant) {
+		reply[1] |= conn->frame[1] & (PROTO_CAP_DUPLEX | PROTO_CAP_ROSTER);
+	}
+	if (participant && gatewayToken) {
+		reply[1] |= conn->frame[1] & PROTO_CAP_GATEWAY;
+	}
+	conn->caps = reply[1];
+	logDebug("Hello on %d, caps %d", conn->sd, conn->caps);
+
+	if (sendReply(conn, reply, sizeof(reply)) < 0) {
+		return -1;
+	}
+
+	// The name is still to come
+	armTimeout(conn, handshakeTimeout);
+	return 1;
+}
+
+// Handles the control frame readFrame just completed
+// 0 = ignored, 1 = handled
+int handleControlFrame(connStruct* conn) {
+	uint64_t sentAt;
+	uint64_t rtt;
+
+	if (conn->frameSize == PROTO_ROSTER_SIZE && conn->frame[0] == PROTO_ROSTER && (conn->caps & PROTO_CAP_ROSTER)) {
+		rosterRequest(conn);
+		return 1;
+	}
+	if (conn->frameSize != PROTO_PING_SIZE || conn->frame[0] != PROTO_PONG) {
+		return 0;
+	}
+
+	// The token is our own clock reading from when the ping went out
+	memcpy(&sentAt, conn->frame + 1, sizeof(uint64_t));
+	rtt = nowNs() - sentAt;
+
+	conn->pingsOutstanding = 0;
+	counters.pongsReceived++;
+	histRecord(&rttHist, rtt);
+	traceRecord(TRACE_PONG, conn->sd, rtt / 1000, 0);
+	return 1;
+}
+
+// Once a connection is past its handshake, check on it every keepaliveInterval
+void startKeepalive(connStruct* conn) {
+	if (keepaliveInterval <= 0) {
+		return;
+	}
+
+	if (conn->caps & PROTO_CAP_PING) {
+		timerSet(&conn->keepaliveTimer, sendPing, conn);
+		timerSchedule(&timers, &conn->keepaliveTimer, nowNs() + keepaliveInterval * NS_PER_SEC);
+		return;
+	}
+
+	// Old clients can't answer pings, let the kernel probe them instead
+	int on = 1;
+	int count = KEEPALIVE_MISSES;
+
+	setsockopt(conn->sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(conn->sd, IPPROTO_TCP, TCP_KEEPIDLE, &keepaliveInterval, sizeof(keepaliveInterval));
+	setsockopt(conn->sd, IPPROTO_TCP, TCP_KEEPINTVL, &keepaliveInterval, sizeof(keepaliveInterval));
+	setsockopt(conn->sd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+// Timer callback: drop the peer if it slept through the last pings,
+// otherwise ping it again
+void sendPing(void* arg) {
+	connStruct* conn = arg;
+	char ping[PROTO_PING_SIZE];
+	msgBlock* block;
+	uint64_t now = nowNs();
+	int result;
+
+	if (conn->pingsOutstanding >= KEEPALIVE_MISSES) {
+		logInfo("No pong from %d, dropping it", conn->sd);
+		reapConnection(conn);
+		return;
+	}
+
+	ping[0] = PROTO_PING;
+	memcpy(ping + 1, &now, sizeof(uint64_t));
+
+	// Ahead of any chat, or the round trip would measure our queue
+	block = newBlock(ping, sizeof(ping), 1);
+	result = block ? queueFrame(conn, block, LANE_CONTROL) : -1;
+	if (block) {
+		releaseBlock(block);
+	}
+	if (result < 0) {
+		reapConnection(conn);
+		return;
+	}
+
+	conn->pingsOutstanding++;
+	counters.pingsSent++;
+	timerSchedule(&timers, &conn->keepaliveTimer, now + keepaliveInterval * NS_PER_SEC);
+}
+
+// Disconnects whoever owns the connection, as if they had hung up
+void reapConnection(connStruct* conn) {
+	int sd = conn->sd;
+	int i = getParticipantBySD(sd);
+
+	counters.peersReaped++;
+	traceRecord(TRACE_REAPED, sd, 0, 0);
+
+	if (i >= 0) {
+		handleParticipantDisconnect(i);
+		return;
+	}
+
+	for (i = 0; i < MAX_GATEWAYS; i++) {
+		if (gateways[i] == sd) {
+			handleGatewayDisconnect(i);
+			return;
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && participants[i]->obsSD == sd) {
+			handleObserverDisconnect(i);
+			return;
+		}
+		if (remoteObservers[i].sd == sd) {
+			handleRemoteObserverDisconnect(i, 1);
+			return;
+		}
+	}
+}
+
+// Creates the observer's ring and hands it over on the socket
+// -1 = error, 0 = success
+int startRing(connStruct* conn) {
+	char frame[sizeof(uint16_t) + PROTO_RING_SIZE];
+	char control[CMSG_SPACE(sizeof(int) * 2)];
+	uint16_t header = PROTO_CONTROL | PROTO_RING_SIZE;
+	struct iovec iov = { frame, sizeof(frame) };
+	struct msghdr message;
+	struct cmsghdr* cmsg;
+	ringStruct* ring = malloc(sizeof(ringStruct));
+
+	if (!ring || ringCreate(ring, ringSize) < 0) {
+		logWarn("Cannot create a ring for %d", conn->sd);
+		free(ring);
+		return -1;
+	}
+
+	memcpy(frame, &header, sizeof(uint16_t));
+	frame[sizeof(uint16_t)] = PROTO_RING;
+	memcpy(frame + sizeof(uint16_t) + 1, &ring->header->size, sizeof(uint32_t));
+
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+	memcpy(CMSG_DATA(cmsg), &ring->memFD, sizeof(int));
+	memcpy(CMSG_DATA(cmsg) + sizeof(int), &ring->eventFD, sizeof(int));
+
+	// The socket is empty, the 'Y' just went out. If it is still queued the
+	// descriptors would overtake it.
+	if (conn->queued || sendmsg(conn->sd, &message, MSG_NOSIGNAL) != sizeof(frame)) {
+		ringClose(ring);
+		free(ring);
+		return -1;
+	}
+
+	conn->ring = ring;
+	return 0;
+}
+
+// queueFrame for a ring. A full ring either costs the observer its
+// connection or costs it the message, the producer never waits.
+// -1 = observer dropped, 0 = success
+int ringDeliver(connStruct* conn, msgBlock* block) {
+	int result = ringPut(conn->ring, block->data, block->size);
+
+	if (result < 0) {
+		counters.ringOverruns++;
+		if (!ringDropOnOverrun) {
+			logWarn("Ring of %d is full, dropping it", conn->sd);
+			return -1;
+		}
+		__atomic_add_fetch(&conn->ring->header->lost, 1, __ATOMIC_RELAXED);
+		counters.drops++;
+		return 0;
+	}
+
+	counters.ringWakeups += result;
+	counters.messagesOut++;
+	counters.bytesOut += block->size;
+	if (block->receivedAt) {
+		histRecord(&ingressHist, nowNs() - block->receivedAt);
+	}
+	return 0;
+}
+
+// "group:port", joins nothing, receivers do that. Also the socket NACKs
+// arrive on, bound to port + 1. A hot restart has handed the socket over.
+// -1 = bad group, 0 = success
+int openFeed(char* group, char* interface) {
+	char copy[64];
+	char* port;
+	struct in_addr local;
+	struct sockaddr_in repair;
+	unsigned char ttl = 1;
+	unsigned char loop = 1;
+
+	snprintf(copy, sizeof(copy), "%s", group);
+	port = strrchr(copy, ':');
+	if (!port) {
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&feedGroup, 0, sizeof(feedGroup));
+	feedGroup.sin_family = AF_INET;
+	feedGroup.sin_port = htons(atoi(port));
+	if (!inet_aton(copy, &feedGroup.sin_addr) || !IN_MULTICAST(ntohl(feedGroup.sin_addr.s_addr)) || atoi(port) <= 0) {
+		return -1;
+	}
+
+	timerSet(&feedTimer, feedHeartbeat, NULL);
+	timerSchedule(&timers, &feedTimer, nowNs() + FEED_HEARTBEAT_MS * 1000000ull);
+
+	if (feedSD >= 0) {
+		return 0;
+	}
+
+	feedSD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (feedSD < 0) {
+		fprintf(stderr, "Error: Socket creation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&repair, 0, sizeof(repair));
+	repair.sin_family = AF_INET;
+	repair.sin_addr.s_addr = INADDR_ANY;
+	repair.sin_port = htons(atoi(port) + 1);
+	if (bind(feedSD, (struct sockaddr*) &repair, sizeof(repair)) < 0) {
+		fprintf(stderr,"Error: Bind failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// One hop, and receivers on this host hear it too (loopback testing)
+	setsockopt(feedSD, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(feedSD, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	if (interface) {
+		if (!inet_aton(interface, &local) || setsockopt(feedSD, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) < 0) {
+			fprintf(stderr,"Error: Bad multicast interface %s\n", interface);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return 0;
+}
+
+// Numbers a public message, keeps it for repairs and sends it to the group
+void feedPublish(msgBlock* block) {
+	msgBlock** slot = &feedHistory[++feedSequence & (FEED_HISTORY - 1)];
+
+	if (*slot) {
+		releaseBlock(*slot);
+	}
+	block->refs++;
+	*slot = block;
+
+	feedSend(feedSequence, block, &feedGroup);
+	counters.feedSent++;
+}
+
+// One datagram: sequence, then the block's own size prefix and body.
+// A NULL block with size sends a heartbeat or GONE.
+// -1 = not sent (the receiver will ask again), 0 = sent
+int feedSend(uint64_t sequence, msgBlock* block, struct sockaddr_in* to) {
+	uint16_t size = PROTO_FEED_BEAT;
+	struct iovec iov[2];
+	struct msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_name = to;
+	message.msg_namelen = sizeof(*to);
+	message.msg_iov = iov;
+	message.msg_iovlen = 2;
+	iov[0].iov_base = &sequence;
+	iov[0].iov_len = sizeof(uint64_t);
+	iov[1].iov_base = block ? block->data : (char*)&size;
+	iov[1].iov_len = block ? block->size : sizeof(uint16_t);
+
+	if (to != &feedGroup && !block) {
+		size = PROTO_FEED_GONE;
+	}
+
+	return (sendmsg(feedSD, &message, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+// Timer callback: the last sequence sent, so receivers notice a lost tail
+void feedHeartbeat(void* arg) {
+	(void)arg;
+
+	feedSend(feedSequence, NULL, &feedGroup);
+	timerSchedule(&timers, &feedTimer, nowNs() + FEED_HEARTBEAT_MS * 1000000ull);
+}
+
+// Answers NACKs from the history, to the asker only
+// Returns the number of NACKs handled
+int handleFeedRepair() {
+	int handled;
+
+	for (handled = 0; handled < FRAME_BUDGET; handled++) {
+		char nack[PROTO_NACK_SIZE];
+		struct sockaddr_in from;
+		socklen_t fromSize = sizeof(from);
+		uint64_t first;
+		uint16_t count;
+
+		if (recvfrom(feedSD, nack, sizeof(nack), 0, (struct sockaddr*) &from, &fromSize) != sizeof(nack)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			continue;
+		}
+
+		memcpy(&first, nack, sizeof(uint64_t));
+		memcpy(&count, nack + sizeof(uint64_t), sizeof(uint16_t));
+		counters.feedNacks++;
+		count = (count < FEED_NACK_MAX) ? count : FEED_NACK_MAX;
+
+		// Nothing past what we have sent, the rest is still in flight
+		for (uint64_t sequence = first; sequence < first + count && sequence <= feedSequence; sequence++) {
+			msgBlock* block = NULL;
+
+			if (sequence && sequence + FEED_HISTORY > feedSequence) {
+				block = feedHistory[sequence & (FEED_HISTORY - 1)];
+			}
+			if (feedSend(sequence, block, &from) == 0 && block) {
+				counters.feedResent++;
+			}
+		}
+	}
+
+	return handled;
+}
+
+// Drains the listen queue, up to ACCEPT_BUDGET connections per wakeup so
+// a reconnect storm cannot stall everyone already connected.
+// Returns number of connections accepted
+int acceptConnections(int listenSD, int observer) {
+	int accepted;
+
+	for (accepted = 0; accepted < ACCEPT_BUDGET; accepted++) {
+		int sd = accept4(listenSD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (sd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Queue drained
+				return accepted;
+			}
+
+			if (errno == EMFILE || errno == ENFILE) {
+				counters.acceptsOverflowed++;
+				shedConnection(listenSD);
+				continue;
+			}
+
+			if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+				continue;
+			}
+
+			logWarn("Accept failed: %s", strerror(errno));
+			return accepted;
+		}
+
+		// select can't watch it, and neither can we
+		if (sd >= FD_SETSIZE || !openConnection(sd)) {
+			counters.acceptsOverflowed++;
+			close(sd);
+			continue;
+		}
+
+		counters.connectionsAccepted++;
+		if (observer) {
+			handleNewObserver(sd);
+		} else {
+			handleNewParticipant(sd);
+		}
+	}
+
+	// More may be waiting, the next wakeup picks them up
+	counters.acceptBudgetHits++;
+	return accepted;
+}
+
+// Out of descriptors: free the spare, take the connection off the queue
+// and close it, so the peer hears now instead of retrying its SYN for
+// minutes and the listener stops waking select.
+void shedConnection(int listenSD) {
+	int sd;
+
+	if (spareFD < 0) {
+		return;
+	}
+
+	close(spareFD);
+	sd = accept(listenSD, NULL, NULL);
+	if (sd >= 0) {
+		close(sd);
+	}
+	spareFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+connStruct* openConnection(int sd) {
+	connStruct* conn = calloc(1, sizeof(connStruct));
+
+	if (conn) {
+		conn->sd = sd;
+		conn->maxFrame = MAX_MESSAGE;
+		timerSet(&conn->timer, connectionTimedOut, conn);
+		timerSet(&conn->keepaliveTimer, sendPing, conn);
+		connections[sd] = conn;
+	}
+	return conn;
+}
+
+void closeConnection(int sd) {
+	if (connections[sd]) {
+		timerCancel(&timers, &connections[sd]->timer);
+		timerCancel(&timers, &connections[sd]->keepaliveTimer);
+		counters.drops += discardQueue(connections[sd]);
+		returnFrame(connections[sd]);
+	}
+	if (connections[sd] && connections[sd]->ring) {
+		ringClose(connections[sd]->ring);
+		free(connections[sd]->ring);
+	}
+	free(connections[sd]);
+	connections[sd] = NULL;
+	close(sd);
+}
+
+// valid = 1, invalid = -1, taken = 0
+int checkUsername(char username[]) {
+	int result;
+	char c;
+	int size = strlen(username);
+	int participantsChecked = 0;
+
+	// 1 to 10 characters
+	if (size < 1 || size > 10) {
+		return -1;
+	}
+
+	// Check Validity
+	for (int i = 0; i < size; i++) {
+		c = username[i];
+		if (!isalnum(c) && !(c == '_')) {
+			return -1;
+		}
+	}
+
+	// Check Availability
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && participants[i]->active) {
+			if (!strcmp(participants[i]->username, username)) {
+				return 0;
+			}
+			participantsChecked++;
+
+			if (participantsChecked >= numParticipants) {
+				break;
+			}
+		}
+	}
+
+	// Taken through a gateway, or on another node
+	if (getVirtualByName(username) >= 0 || directoryLookup(username) >= 0) {
+		return 0;
+	}
+
+	// Name is valid and available
+	return 1;
+}
+
+
+// Returns 0 if successfully added partipant
+int addParticpant(participantStruct* participant) {
+	numParticipants++;
+	maxSD = (participant->parSD < maxSD) ? maxSD : participant->parSD;
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (!participants[i]) {
+			participants[i] = participant;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int getParticipantByName(char username[]) {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && !strcmp(participants[i]->username, username)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int getParticipantBySD(int sd) {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && participants[i]->parSD == sd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void resetFdSet(int sd, int sd2) {
+	FD_ZERO(&writeSet);
+	FD_ZERO(&fdSet);
+	FD_SET(sd, &fdSet);
+	FD_SET(sd2, &fdSet);
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i]) {
+			// A held message means we stop reading and let TCP push back
+			if (!participants[i]->heldUntil) {
+				FD_SET(participants[i]->parSD, &fdSet);
+			}
+			if (participants[i]->obsSD >= 0) {
+				FD_SET(participants[i]->obsSD, &fdSet);
+				if (connections[participants[i]->obsSD]->queued) {
+					FD_SET(participants[i]->obsSD, &writeSet);
+				}
+			}
+			if (connections[participants[i]->parSD]->queued) {
+				FD_SET(participants[i]->parSD, &writeSet);
+			}
+		}
+		if (i < MAX_GATEWAYS && gateways[i]) {
+			FD_SET(gateways[i], &fdSet);
+			if (connections[gateways[i]]->queued) {
+				FD_SET(gateways[i], &writeSet);
+			}
+		}
+		// Waiting on another node's answer, nothing to read until then
+		if (unconObsSD[i] && !connections[unconObsSD[i]]->attachNode) {
+			FD_SET(unconObsSD[i], &fdSet);
+		}
+		if (unconObsSD[i] && connections[unconObsSD[i]]->queued) {
+			FD_SET(unconObsSD[i], &writeSet);
+		}
+		if (closingSD[i]) {
+			FD_SET(closingSD[i], &writeSet);
+		}
+		if (remoteObservers[i].sd) {
+			FD_SET(remoteObservers[i].sd, &fdSet);
+			if (connections[remoteObservers[i].sd]->queued) {
+				FD_SET(remoteObservers[i].sd, &writeSet);
+			}
+		}
+	}
+
+	if (nodeListenSD >= 0) {
+		FD_SET(nodeListenSD, &fdSet);
+	}
+	if (unixParListenSD >= 0) {
+		FD_SET(unixParListenSD, &fdSet);
+	}
+	if (unixObsListenSD >= 0) {
+		FD_SET(unixObsListenSD, &fdSet);
+	}
+	if (feedSD >= 0) {
+		FD_SET(feedSD, &fdSet);
+	}
+	for (int k = 0; k < numNodes; k++) {
+		if (nodes[k].sd < 0) {
+			continue;
+		}
+		if (nodes[k].connecting) {
+			// Writable once the connect is done
+			FD_SET(nodes[k].sd, &writeSet);
+			continue;
+		}
+		FD_SET(nodes[k].sd, &fdSet);
+		if (connections[nodes[k].sd]->queued) {
+			FD_SET(nodes[k].sd, &writeSet);
+		}
+	}
+	for (int p = 0; p < MAX_NODES; p++) {
+		if (pendingNodeSD[p]) {
+			FD_SET(pendingNodeSD[p], &fdSet);
+		}
+	}
+
+	if (adminSD >= 0) {
+		FD_SET(adminSD, &fdSet);
+		for (int i = 0; i < MAX_ADMINS; i++) {
+			if (admins[i].sd && admins[i].response) {
+				FD_SET(admins[i].sd, &writeSet);
+			} else if (admins[i].sd) {
+				FD_SET(admins[i].sd, &fdSet);
+			}
+		}
+	}
+}
+
+void printParticipants () {
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i]) {
+			printParticipant(participants[i]);
+		}
+	}
+}
+
+void printParticipant (participantStruct* participant) {
+	logDebug("%s: \tpar:%d\tobs:%d", participant->username, participant->parSD, participant->obsSD);
+}
+
+// SIGHUP: exec a new server, hand it our sockets and exit. If anything
+// goes wrong before the new process confirms, we keep serving.
+void hotRestart() {
+	int channel[2];
+	int count = 0;
+	char fdArg[16];
+	char* args[64];
+	pid_t pid;
+
+	// The new process gets -X fd first, then our arguments minus any -X of our own
+	args[count++] = savedArgv[0];
+	args[count++] = "-X";
+	args[count++] = fdArg;
+	for (int i = 1; savedArgv[i] && count < 63; i++) {
+		if (!strcmp(savedArgv[i], "--")) {
+			break;
+		}
+		if (!strcmp(savedArgv[i], "-X")) {
+			i++;
+			continue;
+		}
+		if (!strncmp(savedArgv[i], "-X", 2)) {
+			continue;
+		}
+		args[count++] = savedArgv[i];
+	}
+	args[count] = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) < 0) {
+		logError("Hot restart: socketpair failed: %s", strerror(errno));
+		return;
+	}
+	snprintf(fdArg, sizeof(fdArg), "%d", channel[1]);
+
+	logInfo("Hot restart: starting %s", savedArgv[0]);
+	logFlush();
+
+	pid = fork();
+	if (pid < 0) {
+		logError("Hot restart: fork failed: %s", strerror(errno));
+		close(channel[0]);
+		close(channel[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		// Only the channel survives exec, everything else comes over it
+		fcntl(channel[1], F_SETFD, 0);
+		execv(savedArgv[0], args);
+		_exit(127);
+	}
+
+	close(channel[1]);
+
+	// New process is up, give it everything and wait for it to take over
+	if (waitChannel(channel[0], 'R') < 0 || sendHandoff(channel[0]) < 0 || waitChannel(channel[0], 'A') < 0) {
+		logError("Hot restart: new process %d did not take over, still serving", (int)pid);
+		close(channel[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	logInfo("Hot restart: handed over to %d", (int)pid);
+	exit(EXIT_SUCCESS);
+}
+
+// Sends listeners and node links, then every participant, pending observer,
+// gateway and observer attached through another node
+// -1 = error, 0 = success
+int sendHandoff(int channel) {
+	handoffRecord record;
+	int fds[7];
+	int count = 2;
+
+	// Nothing waits in a digest across the restart
+	flushPresence(NULL);
+
+	memset(&record, 0, sizeof(record));
+	record.type = HANDOFF_LISTENERS;
+	record.hasAdmin = (adminSD >= 0);
+	record.hasNodes = (nodeListenSD >= 0);
+	record.hasUnixParticipants = (unixParListenSD >= 0);
+	record.hasUnixObservers = (unixObsListenSD >= 0);
+	record.hasFeed = (feedSD >= 0);
+	record.feedSequence = feedSequence;
+	record.rosterVersion = rosterVersion;
+	fds[0] = parListenSD;
+	fds[1] = obsListenSD;
+	if (record.hasAdmin) {
+		fds[count++] = adminSD;
+	}
+	if (record.hasNodes) {
+		fds[count++] = nodeListenSD;
+	}
+	if (record.hasUnixParticipants) {
+		fds[count++] = unixParListenSD;
+	}
+	if (record.hasUnixObservers) {
+		fds[count++] = unixObsListenSD;
+	}
+	if (record.hasFeed) {
+		fds[count++] = feedSD;
+	}
+	if (sendRecord(channel, &record, fds, count) < 0) {
+		return -1;
+	}
+
+	// Links that are up go along, the rest are dialled again
+	for (int k = 0; k < numNodes && !handoffListenersOnly; k++) {
+		if (nodes[k].sd >= 0 && nodes[k].up) {
+			memset(&record, 0, sizeof(record));
+			record.type = HANDOFF_NODE;
+			record.node = k;
+			record.nodeId = nodes[k].id;
+			record.nodeRole = nodes[k].role;
+			packConn(&record.par, connections[nodes[k].sd]);
+			fds[0] = nodes[k].sd;
+			if (sendRecord(channel, &record, fds, 1) < 0 || sendQueue(channel, connections[nodes[k].sd], 0) < 0) {
+				return -1;
+			}
+		}
+	}
+	for (int p = 0; p < MAX_NODES && !handoffListenersOnly; p++) {
+		if (pendingNodeSD[p]) {
+			memset(&record, 0, sizeof(record));
+			record.type = HANDOFF_PENDING_NODE;
+			packConn(&record.par, connections[pendingNodeSD[p]]);
+			fds[0] = pendingNodeSD[p];
+			if (sendRecord(channel, &record, fds, 1) < 0 || sendQueue(channel, connections[pendingNodeSD[p]], 0) < 0) {
+				return -1;
+			}
+		}
+	}
+	for (int d = 0; d < MAX_DIRECTORY && !handoffListenersOnly; d++) {
+		if (directory[d].username[0]) {
+			memset(&record, 0, sizeof(record));
+			record.type = HANDOFF_DIRECTORY;
+			strcpy(record.username, directory[d].username);
+			record.node = directory[d].node;
+			if (sendRecord(channel, &record, fds, 0) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	for (int i = 0; i < MAX_CLIENTS && !handoffListenersOnly; i++) {
+		participantStruct* participant = participants[i];
+
+		if (participant) {
+			memset(&record, 0, sizeof(record));
+			record.type = HANDOFF_PARTICIPANT;
+			strcpy(record.username, participant->username);
+			record.active = participant->active;
+			record.hasObserver = (participant->obsSD >= 0);
+			record.duplex = participant->duplex;
+			record.obsNode = participant->obsNode;
+			record.messageTokens = participant->messageBucket.tokens;
+			record.messageRefilledAt = participant->messageBucket.refilledAt;
+			record.byteTokens = participant->byteBucket.tokens;
+			record.byteRefilledAt = participant->byteBucket.refilledAt;
+			record.heldUntil = participant->heldUntil;
+			record.heldSince = participant->heldSince;
+			record.lastNotice = participant->lastNotice;
+			packConn(&record.par, connections[participant->parSD]);
+			fds[0] = participant->parSD;
+			count = 1;
+			if (record.hasObserver) {
+				connStruct* obsConn = connections[participant->obsSD];
+
+				packConn(&record.obs, obsConn);
+				fds[count++] = participant->obsSD;
+
+				// The ring goes along, the observer keeps reading the same memory
+				record.obsRing = (obsConn->ring != NULL);
+				if (record.obsRing) {
+					fds[count++] = obsConn->ring->memFD;
+					fds[count++] = obsConn->ring->eventFD;
+				}
+			}
+			if (sendRecord(channel, &record, fds, count) < 0 || sendQueue(channel, connections[participant->parSD], 0) < 0) {
+				return -1;
+			}
+			if (record.hasObserver && sendQueue(channel, connections[participant->obsSD], 1) < 0) {
+				return -1;
+			}
+		}
+
+		if (unconObsSD[i]) {
+			memset(&record, 0, sizeof(record));
+			record.type = HANDOFF_PENDING;
+			packConn(&record.par, connections[unconObsSD[i]]);
+			fds[0] = unconObsSD[i];
+			if (sendRecord(channel, &record, fds, 1) < 0 || sendQueue(channel, connections[unconObsSD[i]], 0) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	for (int g = 0; g < MAX_GATEWAYS && !handoffListenersOnly; g++) {
+		if (!gateways[g]) {
+			continue;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.type = HANDOFF_GATEWAY;
+		packConn(&record.par, connections[gateways[g]]);
+		fds[0] = gateways[g];
+		if (sendRecord(channel, &record, fds, 1) < 0 || sendQueue(channel, connections[gateways[g]], 0) < 0) {
+			return -1;
+		}
+
+		for (int v = 0; v < MAX_VIRTUAL; v++) {
+			if (virtualUsers[v].username[0] && virtualUsers[v].gateway == gateways[g]) {
+				memset(&record, 0, sizeof(record));
+				record.type = HANDOFF_VIRTUAL;
+				strcpy(record.username, virtualUsers[v].username);
+				record.virtualId = virtualUsers[v].id;
+				if (sendRecord(channel, &record, fds, 0) < 0) {
+					return -1;
+				}
+			}
+		}
+	}
+
+	for (int r = 0; r < MAX_CLIENTS && !handoffListenersOnly; r++) {
+		connStruct* obsConn = connections[remoteObservers[r].sd];
+
+		if (!remoteObservers[r].sd) {
+			continue;
+		}
+
+		memset(&record, 0, sizeof(record));
+		record.type = HANDOFF_REMOTE_OBSERVER;
+		strcpy(record.username, remoteObservers[r].username);
+		record.node = remoteObservers[r].node;
+		record.obsRing = (obsConn->ring != NULL);
+		packConn(&record.par, obsConn);
+		fds[0] = remoteObservers[r].sd;
+		count = 1;
+		if (record.obsRing) {
+			fds[count++] = obsConn->ring->memFD;
+			fds[count++] = obsConn->ring->eventFD;
+		}
+		if (sendRecord(channel, &record, fds, count) < 0 || sendQueue(channel, obsConn, 0) < 0) {
+			return -1;
+		}
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.type = HANDOFF_END;
+	return sendRecord(channel, &record, fds, 0);
+}
+
+// New process side, rebuilds participants and connections from the records
+// -1 = error, 0 = success
+int receiveHandoff(int channel) {
+	handoffRecord record;
+	int fds[7];
+	int count;
+	int gateway = -1; /* HANDOFF_VIRTUAL records belong to this one */
+	connStruct* handed[2] = { NULL, NULL }; /* HANDOFF_QUEUE records belong to these */
+	int links = 0;
+
+	// Tell the old process we're ready
+	if (send(channel, "R", 1, 0) != 1) {
+		return -1;
+	}
+
+	while (1) {
+		if (receiveRecord(channel, &record, fds, &count) < 0) {
+			return -1;
+		}
+
+		if (record.type == HANDOFF_END) {
+			break;
+		}
+
+		if (record.type == HANDOFF_LISTENERS && count == 2 + !!record.hasAdmin + !!record.hasNodes + !!record.hasUnixParticipants
+				+ !!record.hasUnixObservers + !!record.hasFeed) {
+			int next = 2;
+
+			parListenSD = fds[0];
+			obsListenSD = fds[1];
+			if (record.hasAdmin) {
+				adminSD = fds[next++];
+				maxSD = (adminSD < maxSD) ? maxSD : adminSD;
+			}
+			if (record.hasNodes) {
+				nodeListenSD = fds[next++];
+			}
+			if (record.hasUnixParticipants) {
+				unixParListenSD = fds[next++];
+			}
+			if (record.hasUnixObservers) {
+				unixObsListenSD = fds[next++];
+			}
+			// The history stays behind, older repairs get GONE
+			if (record.hasFeed) {
+				feedSD = fds[next++];
+				feedSequence = record.feedSequence;
+			}
+			rosterVersion = record.rosterVersion;
+		} else if (record.type == HANDOFF_PARTICIPANT && count >= 1) {
+			participantStruct* participant = calloc(1, sizeof(participantStruct));
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!participant || !conn) {
+				return -1;
+			}
+			handed[0] = conn;
+			handed[1] = NULL;
+
+			participant->parSD = fds[0];
+			strcpy(participant->username, record.username);
+			participant->active = record.active;
+			participant->obsSD = -1;
+			participant->obsNode = (record.obsNode >= 0 && record.obsNode < numNodes) ? record.obsNode : -1;
+			participant->duplex = record.duplex;
+			participant->messageBucket.tokens = record.messageTokens;
+			participant->messageBucket.refilledAt = record.messageRefilledAt;
+			participant->byteBucket.tokens = record.byteTokens;
+			participant->byteBucket.refilledAt = record.byteRefilledAt;
+			participant->heldUntil = record.heldUntil;
+			participant->heldSince = record.heldSince;
+			participant->lastNotice = record.lastNotice;
+			timerSet(&participant->holdTimer, releaseHeldMessage, participant);
+			if (participant->heldUntil) {
+				timerSchedule(&timers, &participant->holdTimer, participant->heldUntil);
+			}
+
+			// Deadlines start over, or once a held message goes out
+			if (participant->active && !participant->heldUntil) {
+				armTimeout(conn, idleTimeout);
+				startKeepalive(conn);
+			} else if (!participant->active) {
+				armTimeout(conn, handshakeTimeout);
+			}
+
+			if (record.hasObserver && count == 2 + 2 * !!record.obsRing) {
+				connStruct* obsConn = unpackConn(&record.obs, fds[1]);
+
+				if (!obsConn) {
+					return -1;
+				}
+				if (record.obsRing) {
+					obsConn->ring = malloc(sizeof(ringStruct));
+					if (!obsConn->ring || ringMap(obsConn->ring, fds[2], fds[3]) < 0) {
+						return -1;
+					}
+				}
+				participant->obsSD = fds[1];
+				maxSD = (fds[1] < maxSD) ? maxSD : fds[1];
+				numObservers++;
+				startKeepalive(obsConn);
+				handed[1] = obsConn;
+			}
+
+			addParticpant(participant);
+		} else if (record.type == HANDOFF_PENDING && count == 1) {
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!conn) {
+				return -1;
+			}
+			handed[0] = conn;
+			handed[1] = NULL;
+
+			for (int i = 0; i < MAX_CLIENTS; i++) {
+				if (!unconObsSD[i]) {
+					unconObsSD[i] = fds[0];
+					break;
+				}
+			}
+			maxSD = (fds[0] < maxSD) ? maxSD : fds[0];
+			armTimeout(conn, handshakeTimeout);
+		} else if (record.type == HANDOFF_GATEWAY && count == 1 && numGateways < MAX_GATEWAYS) {
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!conn) {
+				return -1;
+			}
+			conn->maxFrame = sizeof(uint16_t) + MAX_MESSAGE;
+			handed[0] = conn;
+			handed[1] = NULL;
+			gateway = fds[0];
+			for (int g = 0; g < MAX_GATEWAYS; g++) {
+				if (!gateways[g]) {
+					gateways[g] = gateway;
+					break;
+				}
+			}
+			numGateways++;
+			maxSD = (fds[0] < maxSD) ? maxSD : fds[0];
+			startKeepalive(conn);
+		} else if (record.type == HANDOFF_VIRTUAL && count == 0 && gateway >= 0 && numVirtual < MAX_VIRTUAL) {
+			for (int v = 0; v < MAX_VIRTUAL; v++) {
+				if (!virtualUsers[v].username[0]) {
+					strcpy(virtualUsers[v].username, record.username);
+					virtualUsers[v].gateway = gateway;
+					virtualUsers[v].id = record.virtualId;
+					break;
+				}
+			}
+			numVirtual++;
+		} else if (record.type == HANDOFF_NODE && count == 1 && record.node >= 0 && record.node < MAX_NODES + MAX_REPLICAS
+				&& (record.node < numNodes ? nodes[record.node].role == record.nodeRole && nodes[record.node].id == record.nodeId
+				                           : record.nodeRole == ROLE_REPLICA)) {
+			nodeStruct* node = &nodes[record.node];
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!conn) {
+				return -1;
+			}
+			conn->maxFrame = MAX_FRAME;
+			handed[0] = conn;
+			handed[1] = NULL;
+
+			// Replica slots in between stay free
+			while (numNodes <= record.node) {
+				nodes[numNodes].sd = -1;
+				nodes[numNodes].role = ROLE_REPLICA;
+				numNodes++;
+			}
+			node->sd = fds[0];
+			node->up = 1;
+			links++;
+			maxSD = (fds[0] < maxSD) ? maxSD : fds[0];
+			startKeepalive(conn);
+		} else if (record.type == HANDOFF_PENDING_NODE && count == 1) {
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!conn) {
+				return -1;
+			}
+			conn->maxFrame = MAX_FRAME;
+			handed[0] = conn;
+			handed[1] = NULL;
+
+			for (int p = 0; p < MAX_NODES; p++) {
+				if (!pendingNodeSD[p]) {
+					pendingNodeSD[p] = fds[0];
+					break;
+				}
+			}
+			maxSD = (fds[0] < maxSD) ? maxSD : fds[0];
+			armTimeout(conn, handshakeTimeout);
+		} else if (record.type == HANDOFF_DIRECTORY && count == 0 && record.node >= 0 && record.node < numNodes) {
+			for (int d = 0; d < MAX_DIRECTORY; d++) {
+				if (!directory[d].username[0]) {
+					strcpy(directory[d].username, record.username);
+					directory[d].node = record.node;
+					break;
+				}
+			}
+		} else if (record.type == HANDOFF_REMOTE_OBSERVER && count == 1 + 2 * !!record.obsRing
+				&& record.node >= 0 && record.node < numNodes && nodes[record.node].up) {
+			connStruct* conn = unpackConn(&record.par, fds[0]);
+
+			if (!conn) {
+				return -1;
+			}
+			if (record.obsRing) {
+				conn->ring = malloc(sizeof(ringStruct));
+				if (!conn->ring || ringMap(conn->ring, fds[1], fds[2]) < 0) {
+					return -1;
+				}
+			}
+			handed[0] = conn;
+			handed[1] = NULL;
+
+			for (int r = 0; r < MAX_CLIENTS; r++) {
+				if (!remoteObservers[r].sd) {
+					remoteObservers[r].sd = fds[0];
+					strcpy(remoteObservers[r].username, record.username);
+					remoteObservers[r].node = record.node;
+					break;
+				}
+			}
+			maxSD = (fds[0] < maxSD) ? maxSD : fds[0];
+			numObservers++;
+			startKeepalive(conn);
+		} else if (record.type == HANDOFF_QUEUE && count == 0 && (record.queueFor == 0 || record.queueFor == 1)
+				&& handed[record.queueFor]) {
+			if (restoreQueue(handed[record.queueFor], &record) < 0) {
+				return -1;
+			}
+		} else {
+			logError("Hot restart: unexpected record %d with %d descriptors", record.type, count);
+			return -1;
+		}
+	}
+
+	if (parListenSD < 0 || obsListenSD < 0) {
+		return -1;
+	}
+
+	// Everything is ours, the old process can go
+	if (send(channel, "A", 1, 0) != 1) {
+		return -1;
+	}
+	close(channel);
+
+	logInfo("Hot restart: took over %d participants and %d observers", numParticipants, numObservers);
+	if (numGateways) {
+		logInfo("Hot restart: took over %d gateways with %d users", numGateways, numVirtual);
+	}
+	if (links) {
+		logInfo("Hot restart: took over %d node links", links);
+	}
+	return 0;
+}
+
+// One record per message, descriptors riding along as SCM_RIGHTS
+// -1 = error, 0 = success
+int sendRecord(int channel, handoffRecord* record, int* fds, int count) {
+	char control[CMSG_SPACE(sizeof(int) * 7)];
+	struct iovec iov = { record, sizeof(handoffRecord) };
+	struct msghdr message;
+
+	record->magic = HANDOFF_MAGIC;
+	record->version = HANDOFF_VERSION;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+
+	if (count > 0) {
+		struct cmsghdr* header;
+
+		memset(control, 0, sizeof(control));
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+	}
+
+	return (sendmsg(channel, &message, MSG_NOSIGNAL) == sizeof(handoffRecord)) ? 0 : -1;
+}
+
+// -1 = error or a record we don't understand, 0 = success
+int receiveRecord(int channel, handoffRecord* record, int* fds, int* count) {
+	char control[CMSG_SPACE(sizeof(int) * 7)];
+	struct iovec iov = { record, sizeof(handoffRecord) };
+	struct msghdr message;
+	struct pollfd readable = { channel, POLLIN, 0 };
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	*count = 0;
+	if (poll(&readable, 1, HANDOFF_TIMEOUT_MS) <= 0) {
+		return -1;
+	}
+	if (recvmsg(channel, &message, MSG_CMSG_CLOEXEC) != sizeof(handoffRecord)) {
+		return -1;
+	}
+
+	for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+			*count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(header), sizeof(int) * *count);
+		}
+	}
+
+	if (record->magic != HANDOFF_MAGIC || record->version != HANDOFF_VERSION) {
+		logError("Hot restart: handoff version %u, expected %u", record->version, HANDOFF_VERSION);
+		return -1;
+	}
+
+	// select can't watch it
+	for (int i = 0; i < *count; i++) {
+		if (fds[i] >= FD_SETSIZE) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// -1 = timed out, closed or wrong byte, 0 = got it
+int waitChannel(int channel, char expected) {
+	struct pollfd readable = { channel, POLLIN, 0 };
+	char byte;
+
+	if (poll(&readable, 1, HANDOFF_TIMEOUT_MS) <= 0) {
+		return -1;
+	}
+	if (recv(channel, &byte, 1, 0) != 1) {
+		return -1;
+	}
+	return (byte == expected) ? 0 : -1;
+}
+
+// Hands over what is still queued on a connection, so nothing has to reach
+// the wire first. The rest of the frame already on the wire goes first,
+// then each lane's whole frames in order.
+// -1 = error, 0 = success
+int sendQueue(int channel, connStruct* conn, int which) {
+	handoffRecord record;
+
+	if (!conn->queued) {
+		return 0;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.type = HANDOFF_QUEUE;
+	record.queueFor = which;
+
+	if (conn->partial) {
+		record.queueLane = -1;
+		record.queueSize = conn->partial->block->size - conn->sent;
+		memcpy(record.queue, conn->partial->block->data + conn->sent, record.queueSize);
+		if (sendRecord(channel, &record, NULL, 0) < 0) {
+			return -1;
+		}
+	}
+
+	for (int lane = 0; lane < LANES; lane++) {
+		record.queueLane = lane;
+		record.queueSize = 0;
+
+		for (outEntry* entry = conn->lanes[lane].head; entry; entry = entry->next) {
+			if (record.queueSize + entry->block->size > HANDOFF_CHUNK) {
+				if (sendRecord(channel, &record, NULL, 0) < 0) {
+					return -1;
+				}
+				record.queueSize = 0;
+			}
+			memcpy(record.queue + record.queueSize, entry->block->data, entry->block->size);
+			record.queueSize += entry->block->size;
+		}
+
+		if (record.queueSize && sendRecord(channel, &record, NULL, 0) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Puts handed over output back on its lane. Nothing is written until the
+// old process has let go, the main loop sends it from there.
+// -1 = error, 0 = success
+int restoreQueue(connStruct* conn, handoffRecord* record) {
+	msgBlock* block;
+	outEntry* entry;
+
+	if (record->queueSize <= 0 || record->queueSize > HANDOFF_CHUNK || record->queueLane >= LANES
+			|| (record->queueLane < 0 && conn->partial) || conn->ring) {
+		return -1;
+	}
+
+	block = malloc(sizeof(msgBlock) + record->queueSize);
+	entry = malloc(sizeof(outEntry));
+	if (!block || !entry) {
+		free(block);
+		free(entry);
+		return -1;
+	}
+
+	// Whole frames stay whole, so the lanes can take turns between blocks
+	block->refs = 1;
+	block->size = record->queueSize;
+	block->receivedAt = 0;
+	memcpy(block->data, record->queue, record->queueSize);
+	entry->next = NULL;
+	entry->block = block;
+
+	if (record->queueLane < 0) {
+		conn->partial = entry;
+		conn->sent = 0;
+	} else {
+		outLane* queue = &conn->lanes[record->queueLane];
+
+		if (queue->tail) {
+			queue->tail->next = entry;
+		} else {
+			queue->head = entry;
+		}
+		queue->tail = entry;
+	}
+	conn->queued += block->size;
+	return 0;
+}
+
+// Receive state of a connection, the part of a frame read so far
+void packConn(handoffConn* packed, connStruct* conn) {
+	packed->headerRead = conn->headerRead;
+	memcpy(packed->header, conn->header, sizeof(packed->header));
+	packed->frameSize = conn->frameSize;
+	packed->bytesRead = conn->bytesRead;
+	packed->caps = conn->caps;
+	packed->roster = conn->roster;
+	packed->attachNode = conn->attachNode;
+
+	// Only a frame still arriving matters, the new process borrows for it
+	if (conn->frame && conn->headerRead) {
+		memcpy(packed->frame, conn->frame, sizeof(packed->frame));
+	}
+}
+
+connStruct* unpackConn(handoffConn* packed, int sd) {
+	connStruct* conn = openConnection(sd);
+
+	if (!conn) {
+		return NULL;
+	}
+
+	conn->headerRead = packed->headerRead;
+	memcpy(conn->header, packed->header, sizeof(conn->header));
+	conn->frameSize = packed->frameSize;
+	conn->bytesRead = packed->bytesRead;
+	conn->caps = packed->caps;
+	conn->roster = packed->roster;
+	conn->attachNode = packed->attachNode;
+	if (conn->headerRead && conn->bytesRead) {
+		conn->frame = borrowFrame();
+		if (!conn->frame) {
+			closeConnection(sd);
+			return NULL;
+		}
+		memcpy(conn->frame, packed->frame, sizeof(packed->frame));
+	}
+	return conn;
+}
+
+void handleRestartSignal(int signal) {
+	(void)signal;
+	restartRequested = 1;
+}
+
+// The participant sent a token where its name would go. The connection
+// becomes a gateway and its participant slot is freed.
+// -1 = refused, 1 = gateway
+int startGateway(int i) {
+	participantStruct* participant = participants[i];
+	int sd = participant->parSD;
+	connStruct* conn = connections[sd];
+	int g;
+
+	for (g = 0; g < MAX_GATEWAYS && gateways[g]; g++) {
+	}
+
+	// Either way the participant slot is done with
+	timerCancel(&timers, &participant->holdTimer);
+	free(participant);
+	participants[i] = NULL;
+	numParticipants--;
+
+	if (g == MAX_GATEWAYS || strcmp(conn->frame, gatewayToken)) {
+		logWarn("Gateway on %d refused", sd);
+		counters.participantDisconnects++;
+		rejectConnection(conn, n);
+		return -1;
+	}
+	if (sendReply(conn, &y, 1) < 0) {
+		counters.participantDisconnects++;
+		closeConnection(sd);
+		return -1;
+	}
+
+	gateways[g] = sd;
+	numGateways++;
+	conn->maxFrame = sizeof(uint16_t) + MAX_MESSAGE;
+	armTimeout(conn, 0);
+	startKeepalive(conn);
+	logInfo("Gateway connected on %d", sd);
+	return 1;
+}
+
+// Same budget as a participant, a gateway speaks for many but is one peer
+// 0 = gateway gone, 1 = still connected
+int handleGatewayInput(int g) {
+	connStruct* conn = connections[gateways[g]];
+
+	for (int frames = 0; frames < FRAME_BUDGET; frames++) {
+		int result = readFrame(conn, 2);
+
+		if (result < 0) {
+			handleGatewayDisconnect(g);
+			return 0;
+		}
+		if (result == 0) {
+			return 1;
+		}
+
+		if (!conn->control) {
+			handleGatewayMessage(g);
+		} else if (!handleControlFrame(conn)) {
+			handleGatewayControl(g);
+		}
+	}
+
+	return 1;
+}
+
+// Registers or drops one of the gateway's users
+// -1 = error, 0 = ignored, 1 = success
+int handleGatewayControl(int g) {
+	int sd = gateways[g];
+	connStruct* conn = connections[sd];
+	char reply[PROTO_REGISTERED_SIZE] = { PROTO_REGISTERED };
+	char username[11];
+	uint16_t id;
+	int v = -1;
+	int valid;
+
+	if (conn->frameSize < 3) {
+		return 0;
+	}
+	memcpy(&id, conn->frame + 1, sizeof(uint16_t));
+
+	if (conn->frame[0] == PROTO_UNREGISTER) {
+		v = getVirtualById(sd, id);
+		if (v >= 0) {
+			unregisterVirtual(v);
+		}
+		return 1;
+	}
+	if (conn->frame[0] != PROTO_REGISTER) {
+		return 0;
+	}
+
+	// Same rules as a participant's name, and the id must be new
+	snprintf(username, sizeof(username), "%.*s", conn->frameSize - 3, conn->frame + 3);
+	valid = (conn->frameSize - 3 > 10 || id == PROTO_GATEWAY_ALL || getVirtualById(sd, id) >= 0) ? -1 : checkUsername(username);
+
+	if (valid > 0) {
+		for (v = 0; v < MAX_VIRTUAL && virtualUsers[v].username[0]; v++) {
+		}
+		valid = (v < MAX_VIRTUAL) ? 1 : -1;
+	}
+
+	memcpy(reply + 1, &id, sizeof(uint16_t));
+	reply[3] = (valid > 0) ? y : (valid < 0) ? n : t;
+
+	msgBlock* block = newBlock(reply, sizeof(reply), 1);
+	if (!block) {
+		return -1;
+	}
+	queueGateway(sd, block, LANE_CONTROL);
+	releaseBlock(block);
+
+	if (valid <= 0) {
+		return 1;
+	}
+
+	strcpy(virtualUsers[v].username, username);
+	virtualUsers[v].gateway = sd;
+	virtualUsers[v].id = id;
+	numVirtual++;
+
+	// Announced like anyone else
+	broadcastNodes(TO_PEERS | TO_REPLICAS, NODE_JOIN, LANE_CONTROL, username, NULL, 0);
+	logInfo("User %s has joined", username);
+	announcePresence(username, 0, 0);
+	return 1;
+}
+
+// Something one of the gateway's users said. Gateways are trusted, so
+// there is no rate limit.
+// -1 = error, 0 = nothing sent, 1 = success
+int handleGatewayMessage(int g) {
+	int sd = gateways[g];
+	connStruct* conn = connections[sd];
+	char* message = conn->frame + sizeof(uint16_t);
+	uint16_t messageSize = conn->frameSize - sizeof(uint16_t);
+	char newMessage[MAX_MESSAGE + 14];
+	char username[11];
+	uint16_t id;
+	int result;
+	int v;
+
+	if (conn->frameSize <= sizeof(uint16_t)) {
+		return 0;
+	}
+	memcpy(&id, conn->frame, sizeof(uint16_t));
+
+	v = getVirtualById(sd, id);
+	if (v < 0) {
+		logDebug("Gateway on %d used unknown id %d", sd, id);
+		return 0;
+	}
+
+	messageReceivedAt = nowNs();
+	counters.messagesIn++;
+	counters.bytesIn += messageSize;
+	traceRecord(TRACE_MESSAGE_IN, sd, messageSize, message[0] == '@');
+
+	sprintf(newMessage, ">%11s: ", virtualUsers[v].username);
+	memcpy(newMessage + 14, message, messageSize);
+	messageSize += 14;
+
+	// Same as handlePrivateMessages, the echo and warning go back through the gateway
+	if (message[0] == '@') {
+		newMessage[0] = '-';
+		result = routePrivate(newMessage, messageSize, username);
+		if (result < 0) {
+			messageSize = sprintf(newMessage, "Warning: user %s doesn't exist...", username);
+			result = sendVirtual(v, newMessage, messageSize, LANE_CONTROL);
+		} else if (result > 0) {
+			result = sendVirtual(v, newMessage, messageSize, LANE_BULK);
+		}
+	} else {
+		if (searchWindow > 0) {
+			searchAdd(&search, newMessage, messageSize);
+		}
+		result = handlePublicMessages(newMessage, messageSize, LANE_BULK);
+	}
+
+	messageReceivedAt = 0;
+	return result;
+}
+
+// Everyone behind the gateway leaves with it
+void handleGatewayDisconnect(int g) {
+	int sd = gateways[g];
+
+	gateways[g] = 0;
+	numGateways--;
+
+	for (int v = 0; v < MAX_VIRTUAL; v++) {
+		if (virtualUsers[v].username[0] && virtualUsers[v].gateway == sd) {
+			unregisterVirtual(v);
+		}
+	}
+
+	closeConnection(sd);
+	logInfo("Gateway on %d disconnected", sd);
+}
+
+void unregisterVirtual(int v) {
+	broadcastNodes(TO_PEERS | TO_REPLICAS, NODE_LEAVE, LANE_CONTROL, virtualUsers[v].username, NULL, 0);
+	announcePresence(virtualUsers[v].username, 1, 0);
+	virtualUsers[v].username[0] = '\0';
+	numVirtual--;
+}
+
+// What an observer of this user would get, tagged with its id
+// -1 = error, 0 = success
+int sendVirtual(int v, char* message, uint16_t messageSize, int lane) {
+	msgBlock* block = newTaggedBlock(virtualUsers[v].id, message, messageSize, 0);
+	int result;
+
+	if (!block) {
+		counters.drops++;
+		return -1;
+	}
+
+	result = queueGateway(virtualUsers[v].gateway, block, lane);
+	releaseBlock(block);
+	return result;
+}
+
+// newBlock with the gateway's id for the user in front of the message
+msgBlock* newTaggedBlock(uint16_t id, const char* message, uint16_t messageSize, int control) {
+	uint16_t size = sizeof(uint16_t) + messageSize;
+	uint16_t header = control ? (PROTO_CONTROL | size) : size;
+	msgBlock* block = malloc(sizeof(msgBlock) + sizeof(uint16_t) + size);
+
+	if (!block) {
+		return NULL;
+	}
+
+	block->refs = 1;
+	block->size = sizeof(uint16_t) + size;
+	block->receivedAt = messageReceivedAt;
+	memcpy(block->data, &header, sizeof(uint16_t));
+	memcpy(block->data + sizeof(uint16_t), &id, sizeof(uint16_t));
+	memcpy(block->data + 2 * sizeof(uint16_t), message, messageSize);
+	return block;
+}
+
+// Like a duplex participant, a gateway too far behind is shut down and
+// the main loop cleans up after it
+// -1 = gateway going away, 0 = success
+int queueGateway(int sd, msgBlock* block, int lane) {
+	connStruct* conn = connections[sd];
+
+	if (queueFrame(conn, block, lane) < 0) {
+		discardQueue(conn);
+		shutdown(sd, SHUT_RDWR);
+		return -1;
+	}
+	return 0;
+}
+
+int getVirtualByName(char* username) {
+	for (int v = 0; v < MAX_VIRTUAL && numVirtual; v++) {
+		if (virtualUsers[v].username[0] && !strcmp(virtualUsers[v].username, username)) {
+			return v;
+		}
+	}
+	return -1;
+}
+
+int getVirtualById(int sd, uint16_t id) {
+	for (int v = 0; v < MAX_VIRTUAL && numVirtual; v++) {
+		if (virtualUsers[v].username[0] && virtualUsers[v].gateway == sd && virtualUsers[v].id == id) {
+			return v;
+		}
+	}
+	return -1;
+}
+
+// "id=host:port" from -N, or "host:port" from -R
+// -1 = malformed or too many nodes
+int addNode(char* spec, int role) {
+	char copy[256]; /* argv stays intact for a hot restart */
+	char* host;
+	char* port;
+	struct hostent* entry;
+	nodeStruct* node = &nodes[numNodes];
+
+	snprintf(copy, sizeof(copy), "%s", spec);
+	host = (role == ROLE_PRIMARY) ? copy : strchr(copy, '=');
+	port = host ? strrchr(host, ':') : NULL;
+	if (!port || numNodes == MAX_NODES) {
+		return -1;
+	}
+	if (role != ROLE_PRIMARY) {
+		*host++ = '\0';
+		node->id = atoi(copy);
+	}
+	*port++ = '\0';
+
+	entry = gethostbyname(host);
+	if ((role != ROLE_PRIMARY && node->id <= 0) || !entry || atoi(port) <= 0) {
+		return -1;
+	}
+	node->role = role;
+	if (role == ROLE_PRIMARY) {
+		primaryNode = numNodes;
+	}
+
+	memset(&node->address, 0, sizeof(node->address));
+	node->address.sin_family = AF_INET;
+	memcpy(&node->address.sin_addr, entry->h_addr, entry->h_length);
+	node->address.sin_port = htons(atoi(port));
+	node->sd = -1;
+	timerSet(&node->retryTimer, dialNode, node);
+	numNodes++;
+	return 0;
+}
+
+// Starts a non-blocking connect to a node, also the retry timer's callback.
+// The main loop finishes it when the socket turns writable.
+void dialNode(void* arg) {
+	nodeStruct* node = arg;
+	int sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (sd < 0 || sd >= FD_SETSIZE) {
+		if (sd >= 0) {
+			close(sd);
+		}
+		timerSchedule(&timers, &node->retryTimer, nowNs() + NODE_RETRY_MS * 1000000ull);
+		return;
+	}
+
+	node->sd = sd;
+	maxSD = (sd < maxSD) ? maxSD : sd;
+
+	if (connect(sd, (struct sockaddr*) &node->address, sizeof(node->address)) == 0) {
+		nodeConnected(node - nodes);
+	} else if (errno == EINPROGRESS) {
+		node->connecting = 1;
+	} else {
+		nodeDown(node - nodes);
+	}
+}
+
+// Our connect went through, introduce ourselves
+void nodeConnected(int k) {
+	nodeStruct* node = &nodes[k];
+
+	node->connecting = 0;
+	if (!openConnection(node->sd)) {
+		nodeDown(k);
+		return;
+	}
+	connections[node->sd]->maxFrame = MAX_FRAME;
+	sendNode(k, (node->role == ROLE_PRIMARY) ? NODE_SUBSCRIBE : NODE_HELLO, LANE_CONTROL, NULL, nodeId, NULL, 0);
+}
+
+// Hellos exchanged: tell the node who lives here, it tells us the same
+void nodeUp(int k) {
+	nodeStruct* node = &nodes[k];
+
+	node->up = 1;
+	startKeepalive(connections[node->sd]);
+	if (node->role == ROLE_REPLICA) {
+		logInfo("Replica linked on %d", node->sd);
+	} else if (node->role == ROLE_PRIMARY) {
+		logInfo("Subscribed to primary");
+	} else {
+		logInfo("Node %d linked", node->id);
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (participants[i] && participants[i]->active) {
+			if (sendNode(k, NODE_JOIN, LANE_CONTROL, participants[i]->username, 0, NULL, 0) < 0) {
+				return;
+			}
+		}
+	}
+	for (int v = 0; v < MAX_VIRTUAL; v++) {
+		if (virtualUsers[v].username[0]) {
+			if (sendNode(k, NODE_JOIN, LANE_CONTROL, virtualUsers[v].username, 0, NULL, 0) < 0) {
+				return;
+			}
+		}
+	}
+}
+
+// Closes the link and forgets everything that went through it. Its users
+// are gone as far as we can tell, our observers for them go too.
+void nodeDown(int k) {
+	nodeStruct* node = &nodes[k];
+	int wasUp = node->up;
+
+	if (node->sd < 0) {
+		return;
+	}
+
+	closeConnection(node->sd);
+	node->sd = -1;
+	node->connecting = 0;
+	node->up = 0;
+
+	if (wasUp) {
+		counters.nodeLinksLost++;
+		if (node->role == ROLE_REPLICA) {
+			logInfo("Replica disconnected");
+		} else if (node->role == ROLE_PRIMARY) {
+			logWarn("Primary lost");
+		} else {
+			logWarn("Node %d lost", node->id);
+		}
+	}
+
+	for (int r = 0; r < MAX_CLIENTS; r++) {
+		if (remoteObservers[r].sd && remoteObservers[r].node == k) {
+			handleRemoteObserverDisconnect(r, 0);
+		}
+		if (participants[r] && participants[r]->obsNode == k) {
+			participants[r]->obsNode = -1;
+		}
+	}
+
+	// Every node with a link to it says the same, so only locally
+	for (int d = 0; d < MAX_DIRECTORY; d++) {
+		if (directory[d].username[0] && directory[d].node == k) {
+			announcePresence(directory[d].username, 1, 1);
+			directory[d].username[0] = '\0';
+		}
+	}
+
+	if (node->role == ROLE_PRIMARY || (node->role == ROLE_PEER && nodeId < node->id)) {
+		timerSchedule(&timers, &node->retryTimer, nowNs() + NODE_RETRY_MS * 1000000ull);
+	}
+}
+
+// A lower node dialling in, it has to say hello before it counts
+// -1 = error, 0 = no room, 1 = waiting for its hello
+int acceptNode(int listenSD) {
+	int sd = accept4(listenSD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (sd < 0) {
+		if (errno == EMFILE || errno == ENFILE) {
+			shedConnection(listenSD);
+		}
+		return -1;
+	}
+
+	if (sd >= FD_SETSIZE || !openConnection(sd)) {
+		close(sd);
+		return 0;
+	}
+	connections[sd]->maxFrame = MAX_FRAME;
+
+	for (int p = 0; p < MAX_NODES; p++) {
+		if (!pendingNodeSD[p]) {
+			pendingNodeSD[p] = sd;
+			maxSD = (sd < maxSD) ? maxSD : sd;
+			armTimeout(connections[sd], handshakeTimeout);
+			return 1;
+		}
+	}
+
+	closeConnection(sd);
+	return 0;
+}
+
+// -1 = dropped, 0 = waiting for more, 1 = linked
+int handlePendingNode(int p) {
+	int sd = pendingNodeSD[p];
+	connStruct* conn = connections[sd];
+	int result = readFrame(conn, 2);
+	int32_t id;
+	int k = -1;
+
+	if (result == 0) {
+		return 0;
+	}
+
+	if (result > 0 && conn->frameSize >= NODE_HEADER && conn->frame[0] == NODE_HELLO) {
+		memcpy(&id, conn->frame + 13, sizeof(int32_t));
+		for (int i = 0; i < numNodes; i++) {
+			if (nodes[i].role == ROLE_PEER && nodes[i].id == id && id < nodeId) {
+				k = i;
+			}
+		}
+		if (k < 0) {
+			logWarn("Hello from unknown node %d", id);
+		}
+	} else if (result > 0 && conn->frameSize >= NODE_HEADER && conn->frame[0] == NODE_SUBSCRIBE) {
+		// Replicas take whichever slot is free
+		for (int i = 0; i < numNodes && k < 0; i++) {
+			if (nodes[i].role == ROLE_REPLICA && nodes[i].sd < 0) {
+				k = i;
+			}
+		}
+		if (k < 0 && numNodes < MAX_NODES + MAX_REPLICAS) {
+			k = numNodes++;
+			nodes[k].sd = -1;
+			nodes[k].role = ROLE_REPLICA;
+		}
+		if (k < 0) {
+			logWarn("No room for another replica");
+		}
+	}
+
+	pendingNodeSD[p] = 0;
+	if (k < 0) {
+		closeConnection(sd);
+		return -1;
+	}
+
+	// It redialled, so whatever we still hold for it is stale
+	nodeDown(k);
+
+	armTimeout(conn, 0);
+	nodes[k].sd = sd;
+	if (sendNode(k, NODE_HELLO, LANE_CONTROL, NULL, nodeId, NULL, 0) < 0) {
+		return -1;
+	}
+	nodeUp(k);
+	return 1;
+}
+
+// Reads frames from a linked node, up to FRAME_BUDGET per wakeup
+// 0 = link gone, 1 = still up
+int handleNodeInput(int k) {
+	int sd = nodes[k].sd;
+
+	for (int frames = 0; frames < FRAME_BUDGET; frames++) {
+		connStruct* conn = connections[sd];
+		int result = readFrame(conn, 2);
+
+		if (result < 0 || (result > 0 && conn->frameSize < NODE_HEADER)) {
+			nodeDown(k);
+			return 0;
+		}
+		if (result == 0) {
+			return 1;
+		}
+
+		counters.nodeFramesIn++;
+		handleNodeFrame(k, conn->frame, conn->frameSize);
+
+		// Something in there took the link down
+		if (nodes[k].sd != sd) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Handles one frame from a linked node
+void handleNodeFrame(int k, char* frame, uint16_t size) {
+	int type = frame[0];
+	int lane = (frame[1] == LANE_CONTROL) ? LANE_CONTROL : LANE_BULK;
+	char username[11];
+	int32_t arg;
+	char* body = frame + NODE_HEADER;
+	uint16_t bodySize = size - NODE_HEADER;
+	int index;
+
+	memcpy(username, frame + 2, 10);
+	username[10] = '\0';
+	memcpy(&arg, frame + 13, sizeof(int32_t));
+
+	switch (type) {
+		case NODE_HELLO:
+			// The answer to ours
+			if (!nodes[k].up) {
+				nodeUp(k);
+			}
+			break;
+		case NODE_JOIN:
+			nodeJoin(k, username);
+			break;
+		case NODE_LEAVE:
+			nodeLeave(k, username);
+			break;
+		case NODE_PUBLIC:
+			deliverPublic(body, bodySize, lane);
+			break;
+		case NODE_PRIVATE:
+			index = getParticipantByName(username);
+			if (index >= 0 && participants[index]->active) {
+				sendMessage(index, body, bodySize, lane);
+			} else if ((index = getVirtualByName(username)) >= 0) {
+				sendVirtual(index, body, bodySize, lane);
+			}
+			break;
+		case NODE_DELIVER:
+			index = getRemoteObserver(username, k);
+			if (index >= 0) {
+				msgBlock* block = newBlock(body, bodySize, 0);
+
+				if (block) {
+					queueRemoteObserver(index, block, lane);
+					releaseBlock(block);
+				}
+			}
+			break;
+		case NODE_ATTACH:
+			nodeAttach(k, username, arg);
+			break;
+		case NODE_ATTACHED:
+			nodeAttached(k, username, arg, bodySize ? body[0] : n);
+			break;
+		case NODE_DETACH:
+			index = getParticipantByName(username);
+			if (index >= 0 && participants[index]->obsNode == k) {
+				participants[index]->obsNode = -1;
+				logInfo("Observer of %s on node %d disconnected", username, nodes[k].id);
+			}
+			break;
+		default:
+			logWarn("Node %d sent unknown frame %d", nodes[k].id, type);
+	}
+}
+
+// Two nodes can let the same name in at once, the lower node id keeps it
+void nodeJoin(int k, char* username) {
+	int index = getParticipantByName(username);
+	int owner = directoryLookup(username);
+
+	if (index >= 0 && participants[index]->active) {
+		if (nodeId < nodes[k].id) {
+			return;
+		}
+		logWarn("User %s also joined on node %d, dropping ours", username, nodes[k].id);
+		handleParticipantDisconnect(index);
+	} else if (owner >= 0) {
+		if (nodes[owner].id < nodes[k].id) {
+			return;
+		}
+		nodeLeave(owner, username);
+	}
+
+	for (int d = 0; d < MAX_DIRECTORY; d++) {
+		if (!directory[d].username[0]) {
+			strcpy(directory[d].username, username);
+			directory[d].node = k;
+			rosterChange(username, 0);
+			return;
+		}
+	}
+}
+
+void nodeLeave(int k, char* username) {
+	for (int d = 0; d < MAX_DIRECTORY; d++) {
+		if (directory[d].node == k && !strcmp(directory[d].username, username)) {
+			directory[d].username[0] = '\0';
+			rosterChange(username, 1);
+		}
+	}
+
+	// Like a local participant, its observer goes with it
+	int r = getRemoteObserver(username, k);
+	if (r >= 0) {
+		handleRemoteObserverDisconnect(r, 0);
+	}
+}
+
+// Another node has an observer for one of ours, sd is its descriptor there
+void nodeAttach(int k, char* username, int32_t sd) {
+	int index = getParticipantByName(username);
+	char result = n;
+
+	if (index >= 0 && participants[index]->active) {
+		result = (participants[index]->obsSD >= 0 || participants[index]->obsNode >= 0 || participants[index]->duplex) ? t : y;
+	} else if (getVirtualByName(username) >= 0) {
+		result = t;
+	}
+
+	if (sendNode(k, NODE_ATTACHED, LANE_CONTROL, username, sd, &result, 1) < 0 || result != y) {
+		return;
+	}
+
+	participants[index]->obsNode = k;
+
+	// Same announcement as a local observer, after the answer on the same link
+	uint8_t size = 26;
+	char message[size];
+
+	sprintf(message, "A new observer has joined");
+
+	handlePublicMessages(message, size, LANE_CONTROL);
+}
+
+// The answer for an observer we asked about, finishes what connectObserver started
+void nodeAttached(int k, char* username, int32_t sd, char result) {
+	int slot = -1;
+	int r = -1;
+	connStruct* conn;
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (sd > 0 && unconObsSD[i] == sd && connections[sd]->attachNode == k + 1) {
+			slot = i;
+		}
+		if (r < 0 && !remoteObservers[i].sd) {
+			r = i;
+		}
+	}
+
+	// Gone while we waited, let the node know it has no observer after all
+	if (slot < 0 || (result == y && r < 0)) {
+		if (result == y) {
+			sendNode(k, NODE_DETACH, LANE_CONTROL, username, 0, NULL, 0);
+		}
+		if (slot >= 0) {
+			unconObsSD[slot] = 0;
+			rejectConnection(connections[sd], n);
+		}
+		return;
+	}
+
+	conn = connections[sd];
+	conn->attachNode = 0;
+	traceRecord(TRACE_OBSERVER_ATTACH, sd, (result == y) ? 1 : (result == t) ? 2 : 0, 0);
+
+	if (result == y) {
+		unconObsSD[slot] = 0;
+		armTimeout(conn, 0);
+
+		if (sendReply(conn, &y, 1) < 0) {
+			closeConnection(sd);
+			sendNode(k, NODE_DETACH, LANE_CONTROL, username, 0, NULL, 0);
+			return;
+		}
+
+		remoteObservers[r].sd = sd;
+		strcpy(remoteObservers[r].username, username);
+		remoteObservers[r].node = k;
+		numObservers++;
+		startKeepalive(conn);
+
+		if ((conn->caps & PROTO_CAP_RING) && startRing(conn) < 0) {
+			handleRemoteObserverDisconnect(r, 1);
+		}
+	} else if (result == t) {
+		if (sendReply(conn, &t, 1) < 0) {
+			closeConnection(sd);
+			unconObsSD[slot] = 0;
+			return;
+		}
+		armTimeout(conn, handshakeTimeout);
+	} else {
+		// Send Rejection, the observer gives up after this
+		unconObsSD[slot] = 0;
+		rejectConnection(conn, n);
+	}
+}
+
+// Frames a node message, the header ahead of the body
+msgBlock* newNodeBlock(int type, int lane, const char* username, int32_t arg, const char* body, uint16_t bodySize) {
+	char frame[MAX_FRAME];
+	msgBlock* block;
+
+	frame[0] = type;
+	frame[1] = lane;
+	memset(frame + 2, 0, 11);
+	if (username) {
+		strncpy(frame + 2, username, 10);
+	}
+	memcpy(frame + 13, &arg, sizeof(int32_t));
+	memcpy(frame + NODE_HEADER, body, bodySize);
+
+	block = newBlock(frame, NODE_HEADER + bodySize, 0);
+
+	// Ingress latency is measured where the message reaches an observer
+	if (block) {
+		block->receivedAt = 0;
+	}
+	return block;
+}
+
+// -1 = node down or dropped, 0 = queued
+int sendNode(int k, int type, int lane, const char* username, int32_t arg, const char* body, uint16_t bodySize) {
+	msgBlock* block;
+	int result;
+
+	// Only the hello goes out before the node has answered
+	if (nodes[k].sd < 0 || (!nodes[k].up && type != NODE_HELLO && type != NODE_SUBSCRIBE)) {
+		return -1;
+	}
+
+	block = newNodeBlock(type, lane, username, arg, body, bodySize);
+	if (!block) {
+		return -1;
+	}
+
+	result = queueNode(k, block, lane);
+	releaseBlock(block);
+	return result;
+}
+
+// Once to every node that is up, peers and/or replicas as to says
+void broadcastNodes(int to, int type, int lane, const char* username, const char* body, uint16_t bodySize) {
+	msgBlock* block = NULL;
+
+	for (int k = 0; k < numNodes; k++) {
+		int wanted = (nodes[k].role == ROLE_PEER && (to & TO_PEERS)) || (nodes[k].role == ROLE_REPLICA && (to & TO_REPLICAS));
+
+		if (!nodes[k].up || !wanted) {
+			continue;
+		}
+		if (!block) {
+			block = newNodeBlock(type, lane, username, 0, body, bodySize);
+			if (!block) {
+				return;
+			}
+		}
+		queueNode(k, block, lane);
+	}
+
+	if (block) {
+		releaseBlock(block);
+	}
+}
+
+// A node that can't keep up is disconnected, like an observer
+// -1 = node dropped, 0 = success
+int queueNode(int k, msgBlock* block, int lane) {
+	if (queueFrame(connections[nodes[k].sd], block, lane) < 0) {
+		nodeDown(k);
+		return -1;
+	}
+	counters.nodeFramesOut++;
+	return 0;
+}
+
+// -1 = observer dropped, 0 = success
+int queueRemoteObserver(int r, msgBlock* block, int lane) {
+	if (queueFrame(connections[remoteObservers[r].sd], block, lane) < 0) {
+		handleRemoteObserverDisconnect(r, 1);
+		return -1;
+	}
+	return 0;
+}
+
+// tell = 1 lets the participant's node know, unless it is the one that told us
+void handleRemoteObserverDisconnect(int r, int tell) {
+	remoteObserver* observer = &remoteObservers[r];
+
+	traceRecord(TRACE_OBSERVER_LEFT, observer->sd, 0, 0);
+	closeConnection(observer->sd);
+	observer->sd = 0;
+
+	numObservers--;
+	counters.observerDisconnects++;
+	logInfo("Observer of %s disconnected", observer->username);
+
+	if (tell) {
+		sendNode(observer->node, NODE_DETACH, LANE_CONTROL, observer->username, 0, NULL, 0);
+	}
+}
+
+int getRemoteObserver(char* username, int k) {
+	for (int r = 0; r < MAX_CLIENTS; r++) {
+		if (remoteObservers[r].sd && remoteObservers[r].node == k && !strcmp(remoteObservers[r].username, username)) {
+			return r;
+		}
+	}
+	return -1;
+}
+
+// Node the username lives on, -1 if no other node has it
+int directoryLookup(char* username) {
+	if (!username[0]) {
+		return -1;
+	}
+	for (int d = 0; d < MAX_DIRECTORY; d++) {
+		if (!strcmp(directory[d].username, username)) {
+			return directory[d].node;
+		}
+	}
+	return -1;
+}
+
+// Socket, bind and listen, exits if any of them fail
+int openListener(struct sockaddr_in* address, int protocol, int backlog) {
+	int optval = 1; /* boolean value when we set socket option */
+	int sd;
+
+	// Create a socket with AF_INET as domain, protocol type as SOCK_STREAM. Not inherited by a hot restart, that gets it over the handoff channel.
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, protocol);
+	if (sd < 0) {
+		fprintf(stderr, "Error: Socket creation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Allow reuse of port - avoid "Bind failed" issues
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
+		fprintf(stderr, "Error Setting socket option failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Bind a local address to the socket
+	if (bind(sd, (struct sockaddr*) address, sizeof(*address)) < 0) {
+		fprintf(stderr,"Error: Bind failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Specify size of request queue.
+	if (listen(sd, backlog) < 0) {
+		fprintf(stderr,"Error: Listen failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Accept drains the queue until it would block
+	fcntl(sd, F_SETFL, O_NONBLOCK);
+	return sd;
+}
+
+// Same as openListener for a Unix socket path, a stale socket file is replaced
+int openUnixListener(const char* path, int backlog) {
+	struct sockaddr_un address;
+	int sd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr,"Error: Socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(address.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		fprintf(stderr, "Error: Socket creation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+		fprintf(stderr,"Error: Bind failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(sd, backlog) < 0) {
+		fprintf(stderr,"Error: Listen failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fcntl(sd, F_SETFL, O_NONBLOCK);
+	return sd;
+}
+
+// Listen on localhost only, statistics are not for the outside world
+int openAdminSocket(int port, int backlog) {
+	struct sockaddr_in aad;
+	int optval = 1;
+	int sd;
+
+	memset(&aad, 0, sizeof(aad));
+	aad.sin_family = AF_INET;
+	aad.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	aad.sin_port = htons(port);
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		fprintf(stderr, "Error: Socket creation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
+		fprintf(stderr, "Error Setting socket option failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bind(sd, (struct sockaddr*) &aad, sizeof(aad)) < 0) {
+		fprintf(stderr,"Error: Bind failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(sd, backlog) < 0) {
+		fprintf(stderr,"Error: Listen failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return sd;
+}
+
+// -1 = error, 0 = no free slot, 1 = success
+int handleNewAdmin(int sd) {
+	if (sd < 0) {
+		return -1;
+	}
+
+	if (sd >= FD_SETSIZE) {
+		close(sd);
+		return 0;
+	}
+
+	for (int i = 0; i < MAX_ADMINS; i++) {
+		if (!admins[i].sd) {
+			admins[i].sd = sd;
+			admins[i].length = 0;
+			admins[i].response = NULL;
+			timerSet(&admins[i].timer, adminTimeout, &admins[i]);
+			timerSchedule(&timers, &admins[i].timer, nowNs() + SEND_TIMEOUT_MS * 1000000ull);
+			maxSD = (sd < maxSD) ? maxSD : sd;
+			return 1;
+		}
+	}
+
+	close(sd);
+	return 0;
+}
+
+// Answers once a full request line (or EOF) is in.
+// Both "stats" over nc and "GET /" from curl get the same text body.
+// The answer is queued and sent as the socket takes it, then closed.
+// -1 = error, 0 = waiting for more, 1 = answered
+int handleAdminRequest(int i) {
+	adminStruct* admin = &admins[i];
+	static char body[SEARCH_RESULTS * (MAX_MESSAGE + 64) + 8192]; /* search results are the biggest */
+	char header[128];
+	int size, headerSize = 0, bodySize;
+
+	size = recv(admin->sd, admin->request + admin->length, sizeof(admin->request) - 1 - admin->length, 0);
+	if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return 0;
+	}
+	if (size < 0) {
+		closeAdmin(i);
+		return -1;
+	}
+
+	admin->length += size;
+	admin->request[admin->length] = '\0';
+
+	// Keep waiting for the end of the line unless the peer is done or the buffer is full
+	if (size > 0 && !strchr(admin->request, '\n') && admin->length < (int)sizeof(admin->request) - 1) {
+		return 0;
+	}
+
+	// "search terms" or "GET /search?q=terms", anything else is stats
+	if (!strncmp(admin->request, "search ", 7)) {
+		bodySize = formatSearch(admin->request + 7, 0, body, sizeof(body));
+	} else if (!strncmp(admin->request, "GET /search?q=", 14)) {
+		bodySize = formatSearch(admin->request + 14, 1, body, sizeof(body));
+	} else {
+		bodySize = formatStats(body, sizeof(body));
+	}
+
+	if (!strncmp(admin->request, "GET ", 4)) {
+		headerSize = snprintf(header, sizeof(header),
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n", bodySize);
+	}
+
+	admin->response = malloc(headerSize + bodySize);
+	if (!admin->response) {
+		closeAdmin(i);
+		return -1;
+	}
+	memcpy(admin->response, header, headerSize);
+	memcpy(admin->response + headerSize, body, bodySize);
+	admin->responseSize = headerSize + bodySize;
+	admin->responseSent = 0;
+	timerSchedule(&timers, &admin->timer, nowNs() + SEND_TIMEOUT_MS * 1000000ull);
+
+	flushAdmin(i);
+	return 1;
+}
+
+// Sends as much of the answer as the socket takes, closing once it is all out
+// -1 = error, 0 = more to send, 1 = done
+int flushAdmin(int i) {
+	adminStruct* admin = &admins[i];
+
+	while (admin->responseSent < admin->responseSize) {
+		int sent = send(admin->sd, admin->response + admin->responseSent,
+				admin->responseSize - admin->responseSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			closeAdmin(i);
+			return -1;
+		}
+		admin->responseSent += sent;
+	}
+
+	closeAdmin(i);
+	return 1;
+}
+
+void closeAdmin(int i) {
+	timerCancel(&timers, &admins[i].timer);
+	free(admins[i].response);
+	admins[i].response = NULL;
+	close(admins[i].sd);
+	admins[i].sd = 0;
+}
+
+// Timer callback: the peer has had SEND_TIMEOUT_MS to send its request,
+// or to take the answer
+void adminTimeout(void* arg) {
+	closeAdmin((adminStruct*)arg - admins);
+}
+
+// Newest messages with every term, one per line after a summary. The
+// query runs to the end of the line, or of the URL with its encoding
+// undone. Returns number of bytes written
+int formatSearch(char* query, int url, char* buffer, int bufferSize) {
+	searchMessage* results[SEARCH_RESULTS];
+	char* from = query;
+	char* to = query;
+	unsigned int code;
+	int offset;
+	int matches;
+	uint64_t started;
+
+	if (searchWindow <= 0) {
+		return snprintf(buffer, bufferSize, "search is off, start the server with -s\n");
+	}
+
+	for (; *from && *from != '\n' && *from != '\r' && !(url && *from == ' '); from++) {
+		if (url && *from == '+') {
+			*to++ = ' ';
+		} else if (url && *from == '%' && isxdigit((unsigned char)from[1]) && isxdigit((unsigned char)from[2])
+				&& sscanf(from + 1, "%2x", &code) == 1 && code) {
+			// Two hex digits, and not a NUL that would cut the query short
+			*to++ = code;
+			from += 2;
+		} else {
+			*to++ = *from;
+		}
+	}
+	*to = '\0';
+
+	started = nowNs();
+	matches = searchQuery(&search, query, results, SEARCH_RESULTS);
+	offset = snprintf(buffer, bufferSize, "%d matches in the last %llu messages, %.3f ms\n", matches,
+			(unsigned long long)((search.lastId < search.window) ? search.lastId : search.window), (nowNs() - started) / 1000000.0);
+
+	for (int r = 0; r < matches && r < SEARCH_RESULTS && offset < bufferSize; r++) {
+		time_t seconds = results[r]->at / NS_PER_SEC;
+		char when[32];
+
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+		offset += snprintf(buffer + offset, bufferSize - offset, "%llu %s.%03d %.*s\n", (unsigned long long)results[r]->id,
+				when, (int)(results[r]->at % NS_PER_SEC / 1000000), results[r]->size, results[r]->text);
+	}
+	return (offset < bufferSize) ? offset : bufferSize - 1;
+}
+
+// Connections waiting in a listener's accept queue
+int listenQueue(int sd) {
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+
+	if (sd < 0 || getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &size) < 0) {
+		return 0;
+	}
+	return info.tcpi_unacked;
+}
+
+// Returns number of bytes written
+int formatStats(char* buffer, int bufferSize) {
+	uint64_t queued = 0;
+	int queuedMax = 0;
+	uint64_t laneQueued = 0;
+	int laneQueuedMax = 0;
+	int pending = 0;
+	int nodesUp = 0;
+	int replicasUp = 0;
+	int offset = 0;
+
+	// Kernel send queue of every observer, and ours in front of it
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		int outq;
+
+		if (participants[i] && participants[i]->obsSD >= 0 && ioctl(participants[i]->obsSD, SIOCOUTQ, &outq) == 0) {
+			queued += outq;
+			queuedMax = (outq > queuedMax) ? outq : queuedMax;
+		}
+		if (participants[i] && participants[i]->obsSD >= 0) {
+			outq = connections[participants[i]->obsSD]->queued;
+			laneQueued += outq;
+			laneQueuedMax = (outq > laneQueuedMax) ? outq : laneQueuedMax;
+		}
+		if (unconObsSD[i]) {
+			pending++;
+		}
+	}
+
+	for (int k = 0; k < numNodes; k++) {
+		if (nodes[k].role == ROLE_REPLICA) {
+			replicasUp += nodes[k].up;
+		} else {
+			nodesUp += nodes[k].up;
+		}
+	}
+
+#define STAT(name, value) \
+	offset += snprintf(buffer + offset, bufferSize - offset, "%s %llu\n", name, (unsigned long long)(value))
+#define LATENCY(name, hist) \
+	offset += snprintf(buffer + offset, bufferSize - offset, \
+		"%s_count %llu\n%s_p50_us %.1f\n%s_p99_us %.1f\n%s_max_us %.1f\n", \
+		name, (unsigned long long)(hist)->count, \
+		name, histPercentile(hist, 50) / 1000.0, \
+		name, histPercentile(hist, 99) / 1000.0, \
+		name, (hist)->max / 1000.0)
+
+	STAT("connections_accepted", counters.connectionsAccepted);
+	STAT("connections_rejected", counters.connectionsRejected);
+	STAT("accepts_overflowed", counters.acceptsOverflowed);
+	STAT("accept_budget_hits", counters.acceptBudgetHits);
+	STAT("listen_queue_participants", listenQueue(parListenSD));
+	STAT("listen_queue_observers", listenQueue(obsListenSD));
+	STAT("participant_disconnects", counters.participantDisconnects);
+	STAT("observer_disconnects", counters.observerDisconnects);
+	STAT("participants", numParticipants);
+	STAT("observers", numObservers);
+	STAT("gateways", numGateways);
+	STAT("virtual_users", numVirtual);
+	STAT("frame_buffers", framesBorrowed);
+	STAT("frame_buffers_idle", framePoolIdle);
+	STAT("observers_pending", pending);
+	STAT("messages_in", counters.messagesIn);
+	STAT("bytes_in", counters.bytesIn);
+	STAT("messages_out", counters.messagesOut);
+	STAT("bytes_out", counters.bytesOut);
+	STAT("drops", counters.drops);
+	STAT("messages_delayed", counters.messagesDelayed);
+	STAT("messages_rejected", counters.messagesRejected);
+	STAT("handshake_timeouts", counters.handshakeTimeouts);
+	STAT("idle_timeouts", counters.idleTimeouts);
+	STAT("pings_sent", counters.pingsSent);
+	STAT("pongs_received", counters.pongsReceived);
+	STAT("peers_reaped", counters.peersReaped);
+	STAT("ring_overruns", counters.ringOverruns);
+	STAT("ring_wakeups", counters.ringWakeups);
+	STAT("feed_sent", counters.feedSent);
+	STAT("feed_nacks", counters.feedNacks);
+	STAT("feed_resent", counters.feedResent);
+	STAT("roster_full", counters.rosterFull);
+	STAT("roster_deltas", counters.rosterDeltas);
+	STAT("roster_version", rosterVersion);
+	STAT("search_messages", (search.lastId < search.window) ? search.lastId : search.window);
+	STAT("search_tokens", search.tokens);
+	STAT("nodes_up", nodesUp);
+	STAT("replicas_up", replicasUp);
+	STAT("node_frames_in", counters.nodeFramesIn);
+	STAT("node_frames_out", counters.nodeFramesOut);
+	STAT("node_links_lost", counters.nodeLinksLost);
+	STAT("log_dropped", logDropped());
+	STAT("observer_sendq_bytes", queued);
+	STAT("observer_sendq_bytes_max", queuedMax);
+	STAT("observer_queued_bytes", laneQueued);
+	STAT("observer_queued_bytes_max", laneQueuedMax);
+	STAT("loop_iterations", counters.loopIterations);
+	STAT("loop_last_us", counters.loopLastNs / 1000);
+	STAT("loop_max_us", counters.loopMaxNs / 1000);
+	LATENCY("latency_ingress", &ingressHist);
+	LATENCY("latency_send", &sendHist);
+	LATENCY("latency_loop", &loopHist);
+	LATENCY("rtt", &rttHist);
+
+#undef STAT
+#undef LATENCY
+
+	return offset;
+}
+
+// Copy everything into the shared segment, readers never call into us
+void publishStats() {
+	static statsPayload payload;
+	int pending = 0;
+
+	if (!statsShm) {
+		return;
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (unconObsSD[i]) {
+			pending++;
+		}
+	}
+
+	payload.publishedNs = nowNs();
+	payload.participants = numParticipants;
+	payload.observers = numObservers;
+	payload.observersPending = pending;
+	payload.counters = counters;
+	payload.ingress = ingressHist;
+	payload.send = sendHist;
+	payload.loop = loopHist;
+	payload.rtt = rttHist;
+
+	statsPublish(statsShm, &payload);
+}
+
+void printHistograms() {
+	histPrint(stdout, "ingress", &ingressHist);
+	histPrint(stdout, "send", &sendHist);
+	histPrint(stdout, "loop", &loopHist);
+	histPrint(stdout, "rtt", &rttHist);
+	fflush(stdout);
+}
+
+// Only set a flag, the event loop does the printing
+void handleStatsSignal(int signal) {
+	(void)signal;
+	statsRequested = 1;
+}
+
+void handleTraceSignal(int signal) {
+	(void)signal;
+	traceRequested = 1;
+}
+
+void dumpTrace() {
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s.%d.%d", tracePrefix, (int)getpid(), traceDumps++);
+	if (traceDump(path) < 0) {
+		logError("Cannot write trace to %s", path);
+		return;
+	}
+	logInfo("Trace written to %s", path);
 }
 
 
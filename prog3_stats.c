@@ -0,0 +1,136 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "prog3_stats.h"
+
+uint64_t histPercentile(const histogram* hist, double percentile) {
+	uint64_t seen = 0;
+	uint64_t target;
+
+	if (!hist->count) {
+		return 0;
+	}
+
+	// Rank of the sample we are looking for, at least the first one
+	target = (uint64_t)(hist->count * (percentile / 100.0));
+	if (target < 1) {
+		target = 1;
+	}
+
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			uint64_t upper = i ? (1ull << i) - 1 : 0;
+
+			// Never report more than we actually saw
+			return (upper < hist->max) ? upper : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+void histPrint(FILE* out, const char* name, const histogram* hist) {
+	double mean = hist->count ? (double)hist->sum / hist->count : 0;
+
+	fprintf(out, "%-10s count=%llu mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+		name,
+		(unsigned long long)hist->count,
+		mean / 1000.0,
+		histPercentile(hist, 50) / 1000.0,
+		histPercentile(hist, 90) / 1000.0,
+		histPercentile(hist, 99) / 1000.0,
+		histPercentile(hist, 99.9) / 1000.0,
+		hist->max / 1000.0);
+}
+
+statsSegment* statsCreate(const char* name) {
+	statsSegment* segment;
+	int fd;
+
+	fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(statsSegment)) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	segment = mmap(NULL, sizeof(statsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Readers ignore the segment until the magic is in place
+	__atomic_store_n(&segment->magic, 0, __ATOMIC_RELAXED);
+	segment->version = STATS_VERSION;
+	segment->payloadSize = sizeof(statsPayload);
+	segment->pid = getpid();
+	segment->startedNs = nowNs();
+	segment->sequence = 0;
+	memset(&segment->payload, 0, sizeof(statsPayload));
+	__atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return segment;
+}
+
+void statsPublish(statsSegment* segment, const statsPayload* payload) {
+	uint64_t sequence = segment->sequence;
+
+	// Odd sequence tells readers a copy is in progress
+	__atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&segment->payload, payload, sizeof(statsPayload));
+
+	__atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+const statsSegment* statsAttach(const char* name) {
+	statsSegment* segment;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	segment = mmap(NULL, sizeof(statsSegment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		return NULL;
+	}
+
+	return segment;
+}
+
+int statsRead(const statsSegment* segment, statsPayload* payload) {
+	uint64_t before, after;
+
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC
+			|| segment->version != STATS_VERSION
+			|| segment->payloadSize != sizeof(statsPayload)) {
+		return -1;
+	}
+
+	do {
+		before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(payload, (const void*)&segment->payload, sizeof(statsPayload));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+#ifndef PROG3_STATS_H
+#define PROG3_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*------------------------------------------------------------------------
+* Latency histograms for the server.
+*
+* Values are nanoseconds, bucketed by power of two so recording is a
+* count-leading-zeros and three adds. Bucket b holds values in
+* [2^(b-1), 2^b), bucket 0 holds zero.
+*------------------------------------------------------------------------
+*/
+
+#define HIST_BUCKETS 64
+
+typedef struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+/*------------------------------------------------------------------------
+* Server counters. Only the event loop writes them, so plain increments
+* are enough on the hot path.
+*------------------------------------------------------------------------
+*/
+
+typedef struct serverCounters {
+	uint64_t connectionsAccepted;
+	uint64_t connectionsRejected; /* turned away with 'N' */
+	uint64_t acceptsOverflowed; /* dropped for lack of descriptors */
+	uint64_t acceptBudgetHits; /* wakeups that left connections queued */
+	uint64_t participantDisconnects;
+	uint64_t observerDisconnects;
+	uint64_t messagesIn;
+	uint64_t bytesIn;
+	uint64_t messagesOut; /* one per observer delivery */
+	uint64_t bytesOut;
+	uint64_t drops; /* deliveries lost to a failed send */
+	uint64_t messagesDelayed; /* held back by the rate limit */
+	uint64_t messagesRejected; /* dropped by the rate limit */
+	uint64_t handshakeTimeouts; /* no username before the deadline */
+	uint64_t idleTimeouts; /* participants silent too long */
+	uint64_t pingsSent;
+	uint64_t pongsReceived;
+	uint64_t peersReaped; /* dropped for missing pings */
+	uint64_t nodeFramesIn; /* from other servers in the federation */
+	uint64_t nodeFramesOut;
+	uint64_t nodeLinksLost;
+	uint64_t ringOverruns; /* shared-memory observer found its ring full */
+	uint64_t ringWakeups; /* eventfd writes to idle ring readers */
+	uint64_t feedSent; /* public messages multicast */
+	uint64_t feedNacks;
+	uint64_t feedResent;
+	uint64_t rosterFull; /* roster requests answered with every name */
+	uint64_t rosterDeltas; /* answered with only the changes */
+	uint64_t loopIterations;
+	uint64_t loopLastNs;
+	uint64_t loopMaxNs;
+} serverCounters;
+
+/*------------------------------------------------------------------------
+* Shared-memory statistics segment.
+*
+* The server copies its counters and histograms into the segment once
+* per event loop pass, guarded by a sequence lock: the sequence is odd
+* while a copy is in progress. Readers (chatstat) map the segment
+* read-only and retry until they see the same even sequence before and
+* after their copy, so they never make the server do anything.
+*------------------------------------------------------------------------
+*/
+
+#define STATS_MAGIC 0x534f474c /* "LGOS" */
+#define STATS_VERSION 9
+#define STATS_NAME_FORMAT "/logosnet.%d" /* default name, %d = parPort */
+
+typedef struct statsPayload {
+	uint64_t publishedNs;
+	uint64_t participants;
+	uint64_t observers;
+	uint64_t observersPending;
+	serverCounters counters;
+	histogram ingress;
+	histogram send;
+	histogram loop;
+	histogram rtt; /* keepalive ping round trips */
+} statsPayload;
+
+typedef struct statsSegment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t payloadSize;
+	int32_t pid;
+	uint64_t startedNs;
+	uint64_t sequence;
+	statsPayload payload;
+} statsSegment;
+
+// Server side: create (or take over) the named segment, NULL on failure
+statsSegment* statsCreate(const char* name);
+void statsPublish(statsSegment* segment, const statsPayload* payload);
+
+// Reader side: map an existing segment read-only, NULL on failure
+const statsSegment* statsAttach(const char* name);
+// Consistent copy of the payload, 0 on success, -1 if the layout is unknown
+int statsRead(const statsSegment* segment, statsPayload* payload);
+
+// Monotonic time in nanoseconds
+static inline uint64_t nowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void histRecord(histogram* hist, uint64_t value) {
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	if (bucket >= HIST_BUCKETS) {
+		bucket = HIST_BUCKETS - 1;
+	}
+
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+// Upper bound of the bucket holding the given percentile (0-100)
+uint64_t histPercentile(const histogram* hist, double percentile);
+
+// One line summary: count, mean, p50, p90, p99, p99.9, max (microseconds)
+void histPrint(FILE* out, const char* name, const histogram* hist);
+
+#endif
@@ -0,0 +1,178 @@
+#include <stddef.h>
+
+#include "prog3_timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static uint64_t toTick(uint64_t ns) {
+	return (ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+}
+
+// Puts a timer in the slot for its expiry relative to wheel->current.
+// Anything already due goes in the current slot, which the caller is
+// about to fire (timerExpire) or has arranged to be in the future (timerSchedule).
+static void place(timerWheel* wheel, timerStruct* timer) {
+	uint64_t expires = timer->expires;
+	uint64_t delta = (expires > wheel->current) ? expires - wheel->current : 0;
+	int level = 0;
+
+	// Finest level whose range covers the delta
+	while (level < TIMER_LEVELS - 1 && delta >= (1ull << (TIMER_SLOT_BITS * (level + 1)))) {
+		level++;
+	}
+
+	// Too far out for the top level, park it at the far edge and place it again later
+	if (delta >= (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS))) {
+		expires = wheel->current + (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+	} else if (!delta) {
+		expires = wheel->current;
+	}
+
+	timer->level = level;
+	timer->slot = (expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+
+	timerStruct** head = &wheel->slots[level][timer->slot];
+	timer->next = *head;
+	if (timer->next) {
+		timer->next->link = &timer->next;
+	}
+	timer->link = head;
+	*head = timer;
+
+	wheel->occupied[level] |= 1ull << timer->slot;
+}
+
+static void removeTimer(timerWheel* wheel, timerStruct* timer) {
+	*timer->link = timer->next;
+	if (timer->next) {
+		timer->next->link = timer->link;
+	}
+	timer->link = NULL;
+	timer->next = NULL;
+
+	if (!wheel->slots[timer->level][timer->slot]) {
+		wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+	}
+}
+
+// Nearest occupied slot at or after start, as a distance, 64 if none
+static int nearest(uint64_t occupied, int start) {
+	uint64_t rotated;
+
+	if (!occupied) {
+		return TIMER_SLOTS;
+	}
+	rotated = start ? (occupied >> start) | (occupied << (TIMER_SLOTS - start)) : occupied;
+	return __builtin_ctzll(rotated);
+}
+
+// First tick after current that fires or moves timers, 0 if none
+static uint64_t nextTick(timerWheel* wheel) {
+	uint64_t best = 0;
+
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_SLOT_BITS * level;
+		uint64_t block = (wheel->current >> shift) + 1;
+		int distance = nearest(wheel->occupied[level], block & SLOT_MASK);
+
+		if (distance < TIMER_SLOTS) {
+			uint64_t tick = (block + distance) << shift;
+
+			if (!best || tick < best) {
+				best = tick;
+			}
+		}
+	}
+
+	return best;
+}
+
+void timerInit(timerWheel* wheel, uint64_t now) {
+	*wheel = (timerWheel){ 0 };
+	wheel->current = now / TIMER_TICK_NS;
+}
+
+void timerSet(timerStruct* timer, timerCallback callback, void* arg) {
+	timer->next = NULL;
+	timer->link = NULL;
+	timer->callback = callback;
+	timer->arg = arg;
+}
+
+void timerSchedule(timerWheel* wheel, timerStruct* timer, uint64_t expires) {
+	timerCancel(wheel, timer);
+
+	// The current tick has already been processed
+	timer->expires = toTick(expires);
+	if (timer->expires <= wheel->current) {
+		timer->expires = wheel->current + 1;
+	}
+
+	place(wheel, timer);
+	wheel->count++;
+}
+
+void timerCancel(timerWheel* wheel, timerStruct* timer) {
+	if (timer->link) {
+		removeTimer(wheel, timer);
+		wheel->count--;
+	}
+}
+
+int timerExpire(timerWheel* wheel, uint64_t now) {
+	uint64_t target = now / TIMER_TICK_NS;
+	int fired = 0;
+
+	while (wheel->current < target) {
+		uint64_t tick = nextTick(wheel);
+
+		// Nothing happens before target, skip straight there
+		if (!tick || tick > target) {
+			wheel->current = target;
+			break;
+		}
+		wheel->current = tick;
+
+		// Move timers down from every level that turned over this tick
+		for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+			int shift = TIMER_SLOT_BITS * level;
+
+			if (tick & ((1ull << shift) - 1)) {
+				continue;
+			}
+
+			timerStruct** head = &wheel->slots[level][(tick >> shift) & SLOT_MASK];
+			while (*head) {
+				timerStruct* timer = *head;
+
+				removeTimer(wheel, timer);
+				place(wheel, timer);
+			}
+		}
+
+		// Fire one at a time, a callback may cancel others in the slot
+		timerStruct** head = &wheel->slots[0][tick & SLOT_MASK];
+		while (*head) {
+			timerStruct* timer = *head;
+
+			removeTimer(wheel, timer);
+			wheel->count--;
+			fired++;
+			timer->callback(timer->arg);
+		}
+	}
+
+	return fired;
+}
+
+int timerTimeout(timerWheel* wheel, uint64_t now) {
+	uint64_t tick;
+	uint64_t nowTick = now / TIMER_TICK_NS;
+
+	if (!wheel->count) {
+		return -1;
+	}
+
+	tick = nextTick(wheel);
+	return (tick <= nowTick) ? 0 : (int)(tick - nowTick);
+}
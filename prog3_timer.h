@@ -0,0 +1,65 @@
+#ifndef PROG3_TIMER_H
+#define PROG3_TIMER_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------------
+* Hierarchical timer wheel.
+*
+* Four levels of 64 slots with a 1ms tick, covering about 4.6 hours;
+* later deadlines wait in the top level and are placed again as it turns.
+* Timers are intrusive, so scheduling and cancelling are a few pointer
+* writes with no allocation. A timer lives in the slot of the finest level
+* whose range covers it and moves down a level each time the level above
+* turns over. Occupancy bitmaps let timerTimeout find the next tick that
+* needs attention without walking empty slots.
+*------------------------------------------------------------------------
+*/
+
+#define TIMER_TICK_NS 1000000ull
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef void (*timerCallback)(void* arg);
+
+typedef struct timerStruct {
+	struct timerStruct* next;
+	struct timerStruct** link; /* whatever points at us, NULL when not scheduled */
+	uint64_t expires; /* tick */
+	uint8_t level;
+	uint8_t slot;
+	timerCallback callback;
+	void* arg;
+} timerStruct;
+
+typedef struct timerWheel {
+	uint64_t current; /* last tick processed */
+	int count; /* timers scheduled */
+	uint64_t occupied[TIMER_LEVELS]; /* bit per non-empty slot */
+	timerStruct* slots[TIMER_LEVELS][TIMER_SLOTS];
+} timerWheel;
+
+// Start the wheel at now (CLOCK_MONOTONIC nanoseconds)
+void timerInit(timerWheel* wheel, uint64_t now);
+
+// Set what a timer does, once before it is first scheduled
+void timerSet(timerStruct* timer, timerCallback callback, void* arg);
+
+// Fire at expires (nanoseconds), moving the timer if it is already scheduled
+void timerSchedule(timerWheel* wheel, timerStruct* timer, uint64_t expires);
+
+// Safe to call on a timer that is not scheduled
+void timerCancel(timerWheel* wheel, timerStruct* timer);
+
+// Run everything due by now, returns the number of timers fired
+int timerExpire(timerWheel* wheel, uint64_t now);
+
+// Milliseconds until timerExpire has work to do, -1 if the wheel is empty
+int timerTimeout(timerWheel* wheel, uint64_t now);
+
+static inline int timerPending(const timerStruct* timer) {
+	return timer->link != 0;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "prog3_trace.h"
+
+traceEvent traceEvents[TRACE_EVENTS];
+uint64_t traceHead = 0;
+
+// Tick and clock readings from startup, paired again at dump time to get the tick rate
+static uint64_t initTicks;
+static uint64_t initMonotonicNs;
+static uint64_t initRealtimeNs;
+
+static uint64_t clockNs(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void traceInit(void) {
+	initTicks = traceTicks();
+	initMonotonicNs = clockNs(CLOCK_MONOTONIC);
+	initRealtimeNs = clockNs(CLOCK_REALTIME);
+}
+
+int traceDump(const char* path) {
+	traceFileHeader header;
+	uint64_t ticks = traceTicks();
+	uint64_t elapsedNs = clockNs(CLOCK_MONOTONIC) - initMonotonicNs;
+	uint64_t first;
+	FILE* file;
+
+	// Snapshot the head so events recorded while writing don't shift the window
+	uint64_t head = traceHead;
+
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.eventSize = sizeof(traceEvent);
+	header.count = (head < TRACE_EVENTS) ? head : TRACE_EVENTS;
+	header.nsPerTick = (ticks > initTicks) ? (double)elapsedNs / (ticks - initTicks) : 1.0;
+	header.baseTsc = initTicks;
+	header.baseRealtimeNs = initRealtimeNs;
+	header.dropped = head - header.count;
+
+	file = fopen(path, "wb");
+	if (!file) {
+		return -1;
+	}
+
+	fwrite(&header, sizeof(header), 1, file);
+
+	// Oldest event first, the ring may wrap once
+	first = head - header.count;
+	for (uint64_t i = first; i < head; i++) {
+		fwrite(&traceEvents[i & (TRACE_EVENTS - 1)], sizeof(traceEvent), 1, file);
+	}
+
+	if (fclose(file) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+const char* traceTypeName(uint16_t type) {
+	static const char* names[TRACE_TYPES] = {
+		[TRACE_WAKE] = "wake",
+		[TRACE_ACCEPT_PARTICIPANT] = "accept-participant",
+		[TRACE_ACCEPT_OBSERVER] = "accept-observer",
+		[TRACE_USERNAME] = "username",
+		[TRACE_OBSERVER_ATTACH] = "observer-attach",
+		[TRACE_MESSAGE_IN] = "message-in",
+		[TRACE_SEND] = "send",
+		[TRACE_PARTICIPANT_LEFT] = "participant-left",
+		[TRACE_OBSERVER_LEFT] = "observer-left",
+		[TRACE_TIMEOUT] = "timeout",
+		[TRACE_PONG] = "pong",
+		[TRACE_REAPED] = "reaped",
+	};
+
+	if (type >= TRACE_TYPES || !names[type]) {
+		return "unknown";
+	}
+	return names[type];
+}
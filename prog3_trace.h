@@ -0,0 +1,94 @@
+#ifndef PROG3_TRACE_H
+#define PROG3_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*------------------------------------------------------------------------
+* Event trace ring.
+*
+* A fixed ring of binary events stamped with the TSC. Recording is a
+* rdtsc and a 24 byte store, cheap enough to leave on all the time; the
+* oldest events are overwritten. traceDump writes the ring out oldest
+* first together with what the decoder (tracedump) needs to turn ticks
+* into time.
+*------------------------------------------------------------------------
+*/
+
+#define TRACE_EVENTS 65536 /* must be a power of two */
+#define TRACE_MAGIC 0x45435254 /* "TRCE" */
+#define TRACE_VERSION 1
+
+enum traceType {
+	TRACE_WAKE = 1,           /* select returned, arg = ready count */
+	TRACE_ACCEPT_PARTICIPANT, /* arg = 1 accepted, 0 server full */
+	TRACE_ACCEPT_OBSERVER,    /* arg = 1 accepted, 0 server full */
+	TRACE_USERNAME,           /* participant username, arg = 1 valid, 0 taken, -1 invalid */
+	TRACE_OBSERVER_ATTACH,    /* arg = 1 attached, 0 no such user, 2 already observed */
+	TRACE_MESSAGE_IN,         /* arg = size, arg2 = 1 if private */
+	TRACE_SEND,               /* arg = bytes written, arg2 = nanoseconds spent in writev */
+	TRACE_PARTICIPANT_LEFT,
+	TRACE_OBSERVER_LEFT,
+	TRACE_TIMEOUT,            /* connection dropped by a deadline, arg = 0 username, 1 idle */
+	TRACE_PONG,               /* arg = round trip in microseconds */
+	TRACE_REAPED,             /* connection dropped for missing pings */
+	TRACE_TYPES
+};
+
+typedef struct traceEvent {
+	uint64_t tsc;
+	uint16_t type;
+	uint16_t reserved;
+	int32_t sd;
+	int32_t arg;
+	uint32_t arg2;
+} traceEvent;
+
+typedef struct traceFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t eventSize;
+	uint32_t count; /* events following the header */
+	double nsPerTick;
+	uint64_t baseTsc; /* tick count at baseRealtimeNs */
+	uint64_t baseRealtimeNs;
+	uint64_t dropped; /* events overwritten before the dump */
+} traceFileHeader;
+
+extern traceEvent traceEvents[TRACE_EVENTS];
+extern uint64_t traceHead;
+
+static inline uint64_t traceTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline void traceRecord(uint16_t type, int sd, int32_t arg, uint32_t arg2) {
+	traceEvent* event = &traceEvents[traceHead++ & (TRACE_EVENTS - 1)];
+
+	event->tsc = traceTicks();
+	event->type = type;
+	event->sd = sd;
+	event->arg = arg;
+	event->arg2 = arg2;
+}
+
+// Remember the clock pairing the decoder needs, call once at startup
+void traceInit(void);
+
+// Write the ring to path, -1 on error
+int traceDump(const char* path);
+
+// Printable name of an event type
+const char* traceTypeName(uint16_t type);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "prog3_trace.h"
+
+/*------------------------------------------------------------------------
+* Program: tracedump
+*
+* Purpose: print the timeline stored in a server trace dump (SIGUSR2)
+*
+* Syntax: ./tracedump traceFile
+*
+* traceFile - file written by the server
+*
+* Each line shows wall clock time, time since the first event, time
+* since the previous event, the socket descriptor and the event.
+*
+*------------------------------------------------------------------------
+*/
+
+void printEvent(const traceEvent* event);
+
+int main(int argc, char **argv) {
+	traceFileHeader header;
+	traceEvent event;
+	uint64_t firstTsc = 0, lastTsc = 0;
+	FILE* file;
+
+	if (argc != 2) {
+		fprintf(stderr,"Error: Wrong number of arguments\n");
+		fprintf(stderr,"usage:\n");
+		fprintf(stderr,"./tracedump traceFile\n");
+		exit(EXIT_FAILURE);
+	}
+
+	file = fopen(argv[1], "rb");
+	if (!file) {
+		fprintf(stderr, "Error: Cannot open %s\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC) {
+		fprintf(stderr, "Error: %s is not a trace dump\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (header.version != TRACE_VERSION || header.eventSize != sizeof(traceEvent)) {
+		fprintf(stderr, "Error: Unsupported trace version %u\n", header.version);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%u events, %llu older events overwritten, %.3f ns/tick\n",
+		header.count, (unsigned long long)header.dropped, header.nsPerTick);
+	printf("%-15s %12s %10s %5s  %s\n", "time", "+start(us)", "+prev(us)", "sd", "event");
+
+	for (uint32_t i = 0; i < header.count; i++) {
+		if (fread(&event, sizeof(event), 1, file) != 1) {
+			fprintf(stderr, "Error: Trace truncated after %u events\n", i);
+			break;
+		}
+
+		if (i == 0) {
+			firstTsc = lastTsc = event.tsc;
+		}
+
+		// Wall clock from the startup pairing of ticks and realtime
+		double sinceBase = ((double)event.tsc - (double)header.baseTsc) * header.nsPerTick;
+		uint64_t realtimeNs = header.baseRealtimeNs + (int64_t)sinceBase;
+		time_t seconds = realtimeNs / 1000000000ull;
+		struct tm local;
+		char clock[16];
+
+		localtime_r(&seconds, &local);
+		strftime(clock, sizeof(clock), "%H:%M:%S", &local);
+
+		printf("%s.%06llu %12.3f %10.3f %5d  ",
+			clock,
+			(unsigned long long)(realtimeNs % 1000000000ull) / 1000,
+			(event.tsc - firstTsc) * header.nsPerTick / 1000.0,
+			(event.tsc - lastTsc) * header.nsPerTick / 1000.0,
+			event.sd);
+		printEvent(&event);
+
+		lastTsc = event.tsc;
+	}
+
+	fclose(file);
+	exit(EXIT_SUCCESS);
+}
+
+void printEvent(const traceEvent* event) {
+	printf("%s", traceTypeName(event->type));
+
+	switch (event->type) {
+		case TRACE_WAKE:
+			printf(" ready=%d", event->arg);
+			break;
+		case TRACE_ACCEPT_PARTICIPANT:
+		case TRACE_ACCEPT_OBSERVER:
+			printf(" %s", event->arg ? "accepted" : "server full");
+			break;
+		case TRACE_USERNAME:
+			printf(" %s", event->arg > 0 ? "valid" : event->arg == 0 ? "taken" : "invalid");
+			break;
+		case TRACE_OBSERVER_ATTACH:
+			printf(" %s", event->arg == 1 ? "attached" : event->arg == 0 ? "no such user" : "already observed");
+			break;
+		case TRACE_MESSAGE_IN:
+			printf(" size=%d%s", event->arg, event->arg2 ? " private" : "");
+			break;
+		case TRACE_SEND:
+			printf(" size=%d took=%.3fus", event->arg, event->arg2 / 1000.0);
+			break;
+		case TRACE_TIMEOUT:
+			printf(" %s", event->arg ? "idle" : "no username");
+			break;
+		case TRACE_PONG:
+			printf(" rtt=%dus", event->arg);
+			break;
+	}
+
+	printf("\n");
+}